@@ -0,0 +1,106 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+#include "ModbusTcpFrame.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace ChimeraTK {
+
+  /**
+   * Non-blocking Modbus TCP connection, served by a single process-wide I/O thread (epoll) together with all other
+   * asynchronous connections.
+   *
+   * Requests are encoded with ModbusTcpFrame and sent immediately, without waiting for the responses of earlier
+   * requests. The I/O thread matches the responses by their transaction id and completes the corresponding futures.
+   * Hence callers never block each other, and a device which does not answer only delays its own requests.
+   *
+   * Socket errors and unparsable data close the connection and fail all outstanding requests. Timed out requests are
+   * failed with ETIMEDOUT. Their transaction ids stay reserved until a late response has been discarded or the
+   * connection is closed, so a late response can never be taken for the response to a newer request.
+   */
+  class ModbusAsyncConnection : public std::enable_shared_from_this<ModbusAsyncConnection> {
+   public:
+    ModbusAsyncConnection(std::string host, std::string port);
+    ~ModbusAsyncConnection();
+
+    /** Connect to the server. Throws ChimeraTK::runtime_error on failure. */
+    void connect();
+
+    /** Close the connection. Outstanding requests are failed with the given error. */
+    void close(int error = ENOTCONN);
+
+    /** False if not yet connected, closed or closed due to an error. */
+    bool isConnected();
+
+    /**
+     * Send the request for the transaction. The data buffer of the transaction must stay valid until the future is
+     * ready. The future yields the number of transferred bits/registers, or the negative errno value (libmodbus error
+     * codes, e.g. for exception responses) on failure.
+     */
+    std::future<int> submit(const ModbusTransaction& transaction, uint8_t unitId);
+
+    void setResponseTimeout(std::chrono::milliseconds timeout);
+    void setConnectTimeout(std::chrono::milliseconds timeout);
+
+    /** Interface for the I/O thread: process the events reported by epoll for the socket. */
+    void handleEvents(uint32_t events);
+
+    /** Interface for the I/O thread: fail all requests whose deadline has passed and return the next deadline. */
+    std::chrono::steady_clock::time_point expire(std::chrono::steady_clock::time_point now);
+
+   private:
+    struct Request {
+      ModbusTransaction transaction;
+      uint8_t unitId;
+      std::promise<int> result;
+      std::chrono::steady_clock::time_point deadline;
+    };
+
+    // close the socket and fail all outstanding requests with the given error. Caller must hold _mutex.
+    void fail(int error);
+
+    // send as much of _sendBuffer as possible without blocking. Caller must hold _mutex.
+    void flushSendBuffer();
+
+    // parse all complete frames in _receiveBuffer. Caller must hold _mutex.
+    void processReceived();
+
+    std::string _host;
+    std::string _port;
+
+    // governs access to all members below
+    std::mutex _mutex;
+
+    int _socket{-1};
+
+    // outstanding requests by transaction id
+    std::map<uint16_t, Request> _pending;
+    uint16_t _nextTransactionId{0};
+
+    // transaction ids of timed out requests whose response has not been received yet
+    std::set<uint16_t> _expired;
+
+    // encoded requests which could not be sent yet, and received bytes which do not form a complete frame yet
+    std::vector<uint8_t> _sendBuffer;
+    std::vector<uint8_t> _receiveBuffer;
+
+    // the I/O thread is waiting for the socket to become writable
+    bool _waitingForWritable{false};
+
+    // same defaults as libmodbus
+    std::chrono::milliseconds _responseTimeout{500};
+    std::chrono::milliseconds _connectTimeout{500};
+  };
+
+} // namespace ChimeraTK
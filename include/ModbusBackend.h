@@ -11,11 +11,22 @@
 
 #include "ChimeraTK/NumericAddressedBackend.h"
 #include "modbus/modbus.h"
+#include "ModbusBus.h"
+#include "ModbusByteOrder.h"
+#include "ModbusMergePlanner.h"
+#include "ModbusStatistics.h"
+#include "ModbusTcpFrame.h"
 
+#include <atomic>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace ChimeraTK {
   /**
@@ -26,7 +37,6 @@ namespace ChimeraTK {
     int32_t data32;
   };
 
-  enum ModbusType { rtu, tcp };
   /** A class to provide the modbus backend."
    *
    */
@@ -44,6 +54,25 @@ namespace ChimeraTK {
     void write(uint64_t bar, uint64_t address, int32_t const* data, size_t sizeInBytes) override;
     bool barIndexValid(uint64_t bar) override;
 
+    /**
+     * Write holding registers and read holding registers in a single Modbus transaction (function code 23, "read/write
+     * multiple registers"). The device executes the write before the read. This saves one round trip e.g. for control
+     * loops writing a setpoint and reading back a status block.
+     *
+     * Addresses and sizes are in bytes like in the map file (bar 3) and must be aligned to the 16 bit registers. At
+     * most 121 registers can be written and 125 registers can be read.
+     */
+    void writeAndRead(uint64_t writeAddressInBytes, int32_t const* writeData, size_t writeSizeInBytes,
+        uint64_t readAddressInBytes, int32_t* readData, size_t readSizeInBytes);
+
+    /**
+     * Write the data collected by the write-behind buffer (parameter writeBehind) to the device. This is the explicit
+     * sync point e.g. at the end of an application cycle. Throws ChimeraTK::runtime_error if a transfer fails. The
+     * message lists the failed and the unwritten address ranges, and the device goes into the exception state.
+     * Throws ChimeraTK::logic_error if the device is not opened.
+     */
+    void flush();
+
     std::string readDeviceInfo() override { return "Modbus device"; };
 
     static boost::shared_ptr<DeviceBackend> createInstance(
@@ -58,20 +87,241 @@ namespace ChimeraTK {
 
     void setExceptionImpl() noexcept override;
 
+    /**
+     * Start polling the registers of the given poll group (interrupt number in the map file). Called by the
+     * NumericAddressedBackend when the first wait_for_new_data accessor for the group is activated.
+     */
+    void startInterruptHandlingThread(uint32_t interruptNumber) override;
+
    private:
-    // check code returned by Modbus read/write function and throw appropriate exception on error
-    void checkErrorAndThrow(int rc, int length, uint64_t bar, uint64_t addressInBytes, bool isWrite);
+    using Connection = ModbusBus::Connection;
+
+    /** Lock on a connection of the bus, which records the time it is held in the statistics. */
+    struct ConnectionLock {
+      explicit ConnectionLock(ModbusStatistics& statistics_) : statistics(statistics_) {}
+      ~ConnectionLock() {
+        if(lock.owns_lock()) {
+          statistics.recordLockHold(std::chrono::steady_clock::now() - lockedAt);
+        }
+      }
+      ConnectionLock(const ConnectionLock&) = delete;
+      ConnectionLock& operator=(const ConnectionLock&) = delete;
+
+      ModbusStatistics& statistics;
+      ModbusBus::Lock lock;
+      std::chrono::steady_clock::time_point lockedAt;
+    };
+
+    // check code returned by Modbus read/write function for the given transaction and throw appropriate exception on
+    // error. completedTransactions describes which other transactions of the same transfer have already succeeded,
+    // unknownTransactions those which have been sent without receiving a response (pipelined transfers only).
+    // The bus decides whether the error affects the connection (if any).
+    void checkErrorAndThrow(int rc, Connection* connection, const ModbusTransaction& transaction, uint64_t bar,
+        uint64_t addressInBytes, bool isWrite, const std::string& completedTransactions = {},
+        const std::string& unknownTransactions = {});
+
+    // bookkeeping of a failed transaction shared by all error paths: let the bus decide about the connection, update
+    // the statistics and remember the address for the recovery check. Returns the description of the error.
+    std::string handleFailedTransaction(
+        int rc, Connection* connection, const ModbusTransaction& transaction, uint64_t bar);
+
+    // list the Modbus address ranges of the transactions flagged in completed, for error messages
+    static std::string describeCompleted(
+        const std::vector<ModbusTransaction>& transactions, const std::vector<bool>& completed, uint64_t bar);
+
+    // pick a connection of the bus, lock it for this slave in the given lane and make sure it is usable. Writes use
+    // the urgent lane, reads the bulk lane.
+    Connection& acquireConnection(ConnectionLock& lock, ModbusLane lane = ModbusLane::bulk);
+
+    // read from the cache or the device, without byte order conversion
+    void readRaw(uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes);
+
+    // read from the device through the async transport resp. on any connection of the bus
+    void readDevice(uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes);
+
+    // implementation of read() on the given connection. Caller must hold the connection's mutex.
+    void readImpl(Connection& connection, uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes);
+
+    // split a read into transactions. Throws ChimeraTK::logic_error if the read touches forbidden addresses.
+    std::vector<ModbusTransaction> readTransactions(
+        uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes);
+
+    // write to the device through the async transport resp. on any connection of the bus
+    void writeDevice(uint64_t bar, uint64_t addressInBytes, int32_t const* data, size_t sizeInBytes);
 
-    // governs access to _ctx
-    std::mutex _modbus_mutex;
+    // add a write of bar 0 or 3 to the write-behind buffer, flushing the buffer if it has reached its size limit
+    void bufferWrite(uint64_t bar, uint64_t addressInBytes, int32_t const* data, size_t sizeInBytes);
+
+    // write the buffered data, one multi-register resp. multi-coil write per run of consecutive addresses. Throws
+    // ChimeraTK::runtime_error describing the failed and the unwritten runs.
+    void flushWriteBuffer();
+
+    // flush the write-behind buffer if it contains data of the given range, so reads see the written values
+    void flushOverlapping(uint64_t bar, uint64_t addressInBytes, size_t sizeInBytes);
+
+    // main loop of the write-behind thread, flushes the buffer when its deadline has passed
+    void writeBehindThread();
+
+    // stop and join the write-behind thread
+    void stopWriteBehind();
+
+    // split a write into transactions. address and length are in bytes like in the map file.
+    static std::vector<ModbusTransaction> writeTransactions(uint64_t bar, int address, int length, int32_t const* data);
+
+    // execute the given transactions, pipelined if enabled. Caller must hold the connection's mutex.
+    void transfer(Connection& connection, const std::vector<ModbusTransaction>& transactions, uint64_t bar,
+        uint64_t addressInBytes, bool isWrite);
+
+    // execute a single transaction through the blocking libmodbus API. Returns the libmodbus return code.
+    int transferSingle(Connection& connection, const ModbusTransaction& transaction);
+
+    // execute the given transactions through the async transport, all of them in flight at the same time
+    void transferAsync(
+        const std::vector<ModbusTransaction>& transactions, uint64_t bar, uint64_t addressInBytes, bool isWrite);
+
+    // send up to _pipelineWindow requests back to back and match the responses by their transaction ids (TCP only)
+    void transferPipelined(Connection& connection, const std::vector<ModbusTransaction>& transactions, uint64_t bar,
+        uint64_t addressInBytes, bool isWrite);
+
+    /** Registers which are polled with a common period. Selected by the interrupt number in the map file. */
+    struct PollGroup {
+      std::chrono::milliseconds period{0};
+      std::chrono::steady_clock::time_point nextDue;
+      bool active{false};
+
+      // address ranges of the registers in this group, per bar
+      std::map<uint64_t, std::vector<ModbusAddressRange>> ranges;
+
+      // raw content of the ranges at the last publication, to detect changes (only used by the poller thread)
+      std::vector<uint8_t> lastContent;
+    };
+
+    /** Raw data read by the poller thread. */
+    struct PollBlock {
+      uint64_t bar;
+      ModbusAddressRange range;
+      std::vector<int32_t> data;
+    };
+
+    // main loop of the poller thread
+    void pollerThread();
+
+    // read the ranges of the due groups with merged requests and publish the groups through dispatchInterrupt()
+    void poll(const std::vector<uint32_t>& groups, std::map<uint64_t, std::vector<ModbusAddressRange>> ranges);
+
+    // serve read() from the poll snapshot of the current thread, if it contains the requested range
+    bool readFromSnapshot(uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes);
+
+    // stop and join the poller thread
+    void stopPoller();
+
+    /** Block of the shadow cache for read-only data (bars 1 and 4). */
+    struct CacheBlock {
+      uint64_t bar;
+      ModbusAddressRange range;
+      std::vector<int32_t> data;
+      std::chrono::steady_clock::time_point timestamp;
+      bool valid{false};
+      bool fetching{false};
+    };
+
+    // serve read() from the shadow cache, fetching stale blocks from the device. Returns false if the requested range
+    // is not covered by the cache.
+    bool readFromCache(uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes);
+
+    // invalidate all cache blocks, including those currently being fetched
+    void invalidateCache() noexcept;
+
+    /** Register range whose values are transferred in a non-native byte order (parameter byteOrder). */
+    struct ByteOrderRange {
+      uint64_t bar;
+      ModbusAddressRange range;
+      ModbusByteOrder order;
+    };
+
+    // convert the byte order of the values in the buffer which lie completely within a configured range (in place).
+    // Returns false if no range applies, i.e. the buffer is unchanged.
+    bool applyByteOrder(uint64_t bar, uint64_t addressInBytes, void* data, size_t sizeInBytes) const;
+
+    // thread-safe copy of _lastFailedAddress
+    std::optional<std::pair<uint64_t, uint64_t>> getLastFailedAddress();
+
+    // connection(s) to the device, shared with all other backends using the same serial port resp. TCP server
+    std::shared_ptr<ModbusBus> _bus;
+
+    // slave id used for all transactions of this backend
+    int _slaveId{0};
 
-    modbus_t* _ctx{nullptr};
     std::string _address;
     std::map<std::string, std::string> _parameters;
     ModbusType _type;
     bool _mergingEnabled{true};
 
+    // keep connections open on errors which do not affect the connection itself, e.g. Modbus exception responses
+    bool _keepOpenOnException{false};
+
+    // counters and histograms, readable through the statistics bar
+    ModbusStatistics _statistics;
+
+    // decides how address ranges are combined into requests, see ModbusMergePlanner
+    ModbusMergePlanner _planner;
+
+    // maximum number of Modbus TCP transactions in flight at the same time (1 = no pipelining)
+    size_t _pipelineWindow{1};
+
+    // poll groups by interrupt number, configured with the "pollPeriods" parameter. Only the active flag and nextDue
+    // are modified after construction (protected by _pollMutex).
+    std::map<uint32_t, PollGroup> _pollGroups;
+    std::mutex _pollMutex;
+    std::condition_variable _pollCondition;
+    std::thread _pollerThread;
+    bool _pollerShutdown{false};
+
+    // publish poll groups only if any of their registers has changed
+    bool _pollOnlyChanged{false};
+
+    // poll snapshot while the poller thread dispatches, so the accessors' reads are served from memory. The pointer
+    // is only accessed by the dispatching thread, whose id is stored in _snapshotThread (default id otherwise).
+    const std::vector<PollBlock>* _currentSnapshot{nullptr};
+    std::atomic<std::thread::id> _snapshotThread;
+
+    // shadow cache blocks, sorted by bar and address. The blocks are fixed after construction, their content is
+    // protected by _cacheMutex.
+    std::vector<CacheBlock> _cache;
+    std::mutex _cacheMutex;
+    std::condition_variable _cacheCondition;
+
+    // incremented on invalidation, so fetches started before are not stored
+    uint64_t _cacheGeneration{0};
+
+    // maximum time written data stays in the write-behind buffer (0 disables the buffer), and number of buffered
+    // registers resp. coils which triggers an immediate flush
+    std::chrono::milliseconds _writeBehind{0};
+    size_t _writeBehindMaxSize{MODBUS_MAX_WRITE_REGISTERS};
+
+    // buffered values by bar and Modbus address (coils as 0/1, registers in device byte order), and the total
+    // number of buffered values. Protected by _writeBufferMutex.
+    std::map<uint64_t, std::map<int, uint16_t>> _writeBuffer;
+    size_t _writeBufferSize{0};
+    std::chrono::steady_clock::time_point _writeBufferDeadline;
+    std::mutex _writeBufferMutex;
+    std::condition_variable _writeBufferCondition;
+    std::thread _writeBehindThread;
+    bool _writeBehindShutdown{false};
+
+    // held while the buffered data is written, so overlapping reads can wait for it
+    std::mutex _flushMutex;
+
+    // ranges with a non-native byte order, empty if not configured
+    std::vector<ByteOrderRange> _byteOrders;
+
+    // maximum age of cached data, 0 disables the cache
+    std::chrono::milliseconds _cacheMaxAge{0};
+
     // Address of last exception - used to check whether the exception has been recovered in open()
     std::optional<std::pair<uint64_t, uint64_t>> _lastFailedAddress;
+
+    // governs access to _lastFailedAddress
+    std::mutex _lastFailedAddressMutex;
   };
 } // namespace ChimeraTK
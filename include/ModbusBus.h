@@ -0,0 +1,237 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+#include "modbus/modbus.h"
+#include "ModbusAsyncConnection.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ChimeraTK {
+
+  enum ModbusType { rtu, tcp };
+
+  /** Priority of a transfer: writes are urgent, reads are bulk transfers. */
+  enum class ModbusLane { urgent, bulk };
+
+  /**
+   * Mutex with two priority lanes. Within each lane, the lock is granted in the order of the lock requests, so no user
+   * of a shared bus can starve the others. Waiters of the urgent lane are served before waiters of the bulk lane,
+   * unless the first bulk waiter has waited longer than the bulk latency bound. Then a single bulk transfer passes, and
+   * the urgent lane gets the next turn, so neither lane can hold off the other indefinitely.
+   *
+   * A holder of the bulk lane (e.g. a read split into many frames) can let urgent waiters in between two frames with
+   * yieldToUrgent(). It keeps its place in front of the other bulk waiters.
+   *
+   * lock() uses the bulk lane. Satisfies the Lockable requirements, so it can be used with std::unique_lock.
+   */
+  class ModbusLaneMutex {
+   public:
+    void lock() { lock(ModbusLane::bulk); }
+    void lock(ModbusLane lane);
+    bool try_lock();
+    void unlock();
+
+    /**
+     * Temporarily release the lock if urgent waiters are queued, and re-acquire it before any other bulk waiter.
+     * Returns true if the lock has been released in between. Must only be called by the holder of the lock.
+     */
+    bool yieldToUrgent();
+
+    /** Maximum time bulk waiters (including a yielding holder) let urgent waiters pass. */
+    void setBulkMaxWait(std::chrono::milliseconds maxWait);
+
+    /** Number of lock requests currently queued in the given lane (e.g. for tests). */
+    size_t nWaiting(ModbusLane lane);
+
+   private:
+    using Clock = std::chrono::steady_clock;
+
+    // true if the bulk lane has waited longer than the latency bound and the urgent lane does not have the next turn.
+    // Caller must hold _mutex.
+    bool bulkOverdue(Clock::time_point now) const;
+
+    // true if urgent waiters are queued. Caller must hold _mutex.
+    bool urgentWaiting() const;
+
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _locked{false};
+
+    // tickets per lane (index: ModbusLane)
+    uint64_t _nextTicket[2]{0, 0};
+    uint64_t _nowServing[2]{0, 0};
+
+    // arrival times of the bulk waiters, in ticket order
+    std::deque<Clock::time_point> _bulkArrivals;
+
+    // the holder of the bulk lane has released the lock in yieldToUrgent() at the given time
+    bool _bulkYielded{false};
+    Clock::time_point _yieldedSince;
+
+    std::chrono::milliseconds _bulkMaxWait{100};
+
+    // an overdue bulk transfer has taken the lock while urgent waiters were queued, so the next turn is theirs
+    bool _urgentTurn{false};
+  };
+
+  /**
+   * Connection(s) to one Modbus endpoint, i.e. a serial port or a TCP server/gateway. All ModbusBackend instances
+   * talking to the same endpoint share one ModbusBus, e.g. several slaves on one RS-485 line. Each transaction selects
+   * the slave id of the backend executing it.
+   *
+   * Errors are isolated per slave where possible: Modbus exception responses and (in RTU mode) timeouts of a single
+   * slave leave the connection intact. Only connection-level errors mark the connection as broken, so it is
+   * re-established on the next open.
+   *
+   * With the parameter transport=async (TCP only), the bus uses a single ModbusAsyncConnection instead of the
+   * libmodbus contexts.
+   *
+   * The timeouts are taken from the parameters connectTimeout, responseTimeout and byteTimeout (in milliseconds). With
+   * the parameter reconnect=1, a background thread re-establishes connections which have been closed while the bus is
+   * in use, with exponential backoff. The new connections are kept in reserve until the next open(), which then does
+   * not have to wait for the connect. All backends using the bus must agree on these settings.
+   *
+   * Access to each connection is arbitrated by a ModbusLaneMutex. The latency bound of its bulk lane is taken from the
+   * parameter bulkMaxWait (in milliseconds).
+   */
+  class ModbusBus {
+   public:
+    /** A single connection to the endpoint. Multiple connections can be pooled in TCP mode. */
+    struct Connection {
+      // governs access to all other members
+      ModbusLaneMutex mutex;
+
+      modbus_t* ctx{nullptr};
+
+      // transaction id for the next pipelined request
+      uint16_t nextTransactionId{0};
+
+      // set if the connection needs to be re-established (connection lost or responses out of sync)
+      bool broken{false};
+    };
+
+    using Lock = std::unique_lock<ModbusLaneMutex>;
+
+    /**
+     * Obtain the bus for the given endpoint, creating it if necessary. The parameters must be complete (defaults
+     * filled in). Throws ChimeraTK::logic_error if the bus exists already with different settings (serial line,
+     * timeouts, reconnect, bulkMaxWait).
+     */
+    static std::shared_ptr<ModbusBus> get(ModbusType type, const std::string& address,
+        const std::map<std::string, std::string>& parameters, size_t nConnections);
+
+    ModbusBus(ModbusType type, std::string address, std::map<std::string, std::string> parameters,
+        size_t nConnections);
+    ~ModbusBus();
+
+    /**
+     * Connect all connections which are not connected yet, and register the user as open. Connections which are
+     * already established by other users are kept. Returns the number of newly established connections. Throws
+     * ChimeraTK::runtime_error if a connection fails.
+     */
+    size_t open(const void* user);
+
+    /**
+     * Unregister the user. The connections are closed when the last user has closed the bus, and the background
+     * reconnect is stopped.
+     */
+    void close(const void* user);
+
+    /** True if the bus is open by any user other than the given one. */
+    bool isOpenByOthers(const void* user);
+
+    /**
+     * Close all connections resp. only those marked as broken. With reconnect enabled, the closed connections are
+     * re-established in the background while the bus is in use.
+     */
+    void closeConnections(bool onlyBroken);
+
+    /** Pick a connection, preferably an idle one, and lock it for the given slave in the given lane. */
+    Connection& acquire(int slaveId, Lock& lock, ModbusLane lane = ModbusLane::bulk);
+
+    /** Lock the connection with the given index (unless the lock owns it already) for the given slave. */
+    Connection& acquire(size_t index, int slaveId, Lock& lock, ModbusLane lane = ModbusLane::bulk);
+
+    [[nodiscard]] size_t nConnections() const { return _connections.size(); }
+
+    /** The asynchronous connection, or nullptr if the bus uses libmodbus contexts. */
+    [[nodiscard]] ModbusAsyncConnection* asyncConnection() const { return _asyncConnection.get(); }
+
+    /**
+     * Decide after a failed transaction whether the connection is broken. Otherwise, remove any remaining response
+     * data from the line (RTU), so the error does not affect the next slave. Caller must hold the connection's lock.
+     */
+    void handleError(Connection& connection, int error);
+
+   private:
+    // create a new libmodbus context according to the parameters (not yet connected)
+    modbus_t* createContext();
+
+    // create a new libmodbus context with the configured timeouts and connect it. Throws ChimeraTK::runtime_error.
+    modbus_t* connectContext();
+
+    // take a connected context from the reserve, or nullptr if there is none
+    modbus_t* takeReserve();
+
+    // account for a lost connection which has been re-established by open()
+    void reestablished();
+
+    // main loop of the reconnect thread
+    void reconnectThread();
+
+    // stop the reconnect thread and discard the reserve. Caller must hold _openUsersMutex.
+    void stopReconnect();
+
+    ModbusType _type;
+    std::string _address;
+    std::map<std::string, std::string> _parameters;
+
+    std::vector<std::unique_ptr<Connection>> _connections;
+
+    // replaces _connections if transport=async
+    std::shared_ptr<ModbusAsyncConnection> _asyncConnection;
+
+    // index of the connection to try first in acquire()
+    std::atomic<size_t> _nextConnection{0};
+
+    // users which have opened the bus. The mutex also governs starting and stopping the reconnect thread.
+    std::set<const void*> _openUsers;
+    std::mutex _openUsersMutex;
+
+    // timeouts from the parameters, libmodbus defaults if not set
+    std::optional<std::chrono::milliseconds> _connectTimeout;
+    std::optional<std::chrono::milliseconds> _responseTimeout;
+    std::optional<std::chrono::milliseconds> _byteTimeout;
+
+    // background reconnect enabled (parameter reconnect)
+    bool _reconnect{false};
+    std::thread _reconnectThread;
+
+    // governs access to the members below
+    std::mutex _reconnectMutex;
+    std::condition_variable _reconnectCondition;
+
+    // set while the reconnect thread is not running resp. shall terminate
+    bool _reconnectShutdown{true};
+
+    // number of connections closed while the bus is in use, which have not been re-established yet
+    size_t _nLost{0};
+
+    // connected contexts for the lost connections, taken by open()
+    std::vector<modbus_t*> _reserve;
+  };
+
+} // namespace ChimeraTK
@@ -0,0 +1,51 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace ChimeraTK {
+
+  /**
+   * Byte and word order of values spanning one, two or four 16 bit registers, named by the order of the bytes on the
+   * wire with A being the most significant byte, e.g. "ABCD" for big endian 32 bit values.
+   *
+   * The backend natively transfers multi-register values with the least significant register first and the bytes of
+   * each register in Modbus (big endian) order, i.e. "AB", "CDAB" resp. "GHEFCDAB". Other orders are converted in place
+   * on the raw transfer buffer. The conversion is its own inverse, so the same call converts read data from and write
+   * data to the device order.
+   */
+  class ModbusByteOrder {
+   public:
+    ModbusByteOrder() = default;
+
+    /**
+     * Parse the name of a byte order. Supported are "AB", "BA" (16 bit), "ABCD", "CDAB", "BADC", "DCBA" (32 bit) and
+     * "ABCDEFGH", "GHEFCDAB", "BADCFEHG", "HGFEDCBA" (64 bit). Throws ChimeraTK::logic_error for other names.
+     */
+    static ModbusByteOrder parse(const std::string& name);
+
+    /** Number of 16 bit registers per value. */
+    [[nodiscard]] size_t wordsPerValue() const { return _wordsPerValue; }
+
+    /** True if the order differs from the native one, i.e. apply() changes the data. */
+    [[nodiscard]] bool needsConversion() const { return _swapWords || _swapBytes; }
+
+    /** Convert nValues values starting at the given buffer position. The buffer needs no particular alignment. */
+    void apply(void* buffer, size_t nValues) const;
+
+   private:
+    ModbusByteOrder(size_t wordsPerValue, bool swapWords, bool swapBytes)
+    : _wordsPerValue(wordsPerValue), _swapWords(swapWords), _swapBytes(swapBytes) {}
+
+    size_t _wordsPerValue{1};
+
+    // reverse the order of the registers within each value
+    bool _swapWords{false};
+
+    // swap the two bytes of each register
+    bool _swapBytes{false};
+  };
+
+} // namespace ChimeraTK
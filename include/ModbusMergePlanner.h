@@ -0,0 +1,75 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ChimeraTK {
+
+  /** Range of Modbus addresses in units of the bar (registers or bits). end points _after_ the last element. */
+  struct ModbusAddressRange {
+    int begin;
+    int end;
+
+    [[nodiscard]] int length() const { return end - begin; }
+    bool operator==(const ModbusAddressRange& other) const { return begin == other.begin && end == other.end; }
+  };
+
+  /**
+   * Decides how register ranges are combined into Modbus requests.
+   *
+   * Neighbouring ranges are merged across unmapped gaps if the extra data read is cheaper than an additional frame
+   * (MBAP header resp. RTU framing plus round trip), and if the gap does not contain any forbidden address. Forbidden
+   * addresses are address holes which the device rejects with ILLEGAL DATA ADDRESS, they are never requested.
+   *
+   * The plans are used where the backend combines ranges itself, i.e. for the blocks of the shadow cache and the
+   * requests of poll groups. TransferGroups are merged by DeviceAccess, which only merges adjacent or overlapping
+   * registers.
+   *
+   * All addresses are in units of the bar: registers for bars 3 and 4, bits for bars 0 and 1.
+   */
+  class ModbusMergePlanner {
+   public:
+    ModbusMergePlanner() = default;
+
+    /**
+     * Create planner from the backend parameters:
+     *  - maxGapWords: largest gap in registers which is read to merge two ranges (bits: 16 times as many). If not
+     *    given, it is derived from the per-frame overhead of the given Modbus type (and baud rate for RTU).
+     *  - forbiddenRanges: comma separated list of <bar>:<first>-<last> with inclusive map file addresses.
+     */
+    ModbusMergePlanner(bool isTcp, const std::map<std::string, std::string>& parameters);
+
+    /** Register an address range which is mapped in the map file. */
+    void addMappedRange(uint64_t bar, ModbusAddressRange range);
+
+    /** Merge the given ranges of one bar into as few requests as sensible. The result is sorted by address. */
+    [[nodiscard]] std::vector<ModbusAddressRange> plan(uint64_t bar, std::vector<ModbusAddressRange> ranges) const;
+
+    /** Plan of all mapped ranges of the bar, i.e. the largest blocks which are sensible to read in one go. */
+    [[nodiscard]] std::vector<ModbusAddressRange> blocks(uint64_t bar) const;
+
+    /** True if any address in the range is forbidden. */
+    [[nodiscard]] bool containsForbidden(uint64_t bar, ModbusAddressRange range) const;
+
+   private:
+    // largest gap which is merged on the given bar
+    [[nodiscard]] int maxGap(uint64_t bar) const;
+
+    // check whether b (which does not start before a) shall be merged into a
+    [[nodiscard]] bool isWorthMerging(uint64_t bar, const ModbusAddressRange& a, const ModbusAddressRange& b) const;
+
+    // maximum number of registers merged across a gap
+    int _maxGapWords{0};
+
+    // forbidden address ranges per bar, sorted
+    std::map<uint64_t, std::vector<ModbusAddressRange>> _forbidden;
+
+    // mapped address ranges per bar, taken from the map file
+    std::map<uint64_t, std::vector<ModbusAddressRange>> _mapped;
+  };
+
+} // namespace ChimeraTK
@@ -0,0 +1,95 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+#include "ModbusTcpFrame.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ChimeraTK {
+
+  /**
+   * Counters and latency histograms of a ModbusBackend, readable through the virtual bar 5.
+   *
+   * The bar consists of blocks of 32 unsigned 32 bit words (128 bytes). Block 0 contains the connection statistics,
+   * block n (at byte address 128 * n) the statistics of Modbus function code n. Since each function code belongs to
+   * one bar, the latter are also the statistics per bar. All times are in microseconds. Counters wrap around.
+   *
+   * Histograms have 20 buckets: bucket k counts durations in [2^k, 2^(k+1)) us (bucket 0 also counts 0 us, the last
+   * bucket counts everything above).
+   *
+   * All recording functions are lock-free and can be called concurrently.
+   */
+  class ModbusStatistics {
+   public:
+    static constexpr uint64_t bar = 5;
+    static constexpr size_t nBuckets = 20;
+
+    // words per block and number of blocks (function codes up to 23)
+    static constexpr size_t blockWords = 32;
+    static constexpr size_t nBlocks = 24;
+
+    // word indices in block 0
+    enum ConnectionWord {
+      lockAcquisitions = 0,
+      lockWaitSum = 1,
+      lockWaitMax = 2,
+      lockHoldSum = 3,
+      connects = 4,
+      exceptions = 5,
+      lockWaitHistogram = 8
+    };
+
+    // word indices in the function code blocks
+    enum FunctionWord {
+      frames = 0,
+      errors = 1,
+      bytesSent = 2,
+      bytesReceived = 3,
+      latencySum = 4,
+      latencyMax = 5,
+      latencyHistogram = 8
+    };
+
+    /** A register of the statistics bar, to be added to the register catalogue. Address is in bytes. */
+    struct RegisterDescription {
+      std::string name;
+      uint64_t address;
+      uint32_t nElements;
+    };
+
+    explicit ModbusStatistics(bool isTcp) : _isTcp(isTcp) {}
+
+    /** List of all registers, names are relative to the statistics directory. */
+    static std::vector<RegisterDescription> describeRegisters();
+
+    /** Record a completed or failed transaction. Bytes on the wire are derived from the transaction. */
+    void recordTransaction(const ModbusTransaction& transaction, bool success, std::chrono::nanoseconds latency);
+
+    /** Same as above, with explicit PDU sizes in bytes (without MBAP header resp. address and CRC). */
+    void recordTransaction(int function, size_t requestPduBytes, size_t responsePduBytes, bool success,
+        std::chrono::nanoseconds latency);
+
+    void recordLockWait(std::chrono::nanoseconds duration);
+    void recordLockHold(std::chrono::nanoseconds duration);
+    void recordConnects(size_t nConnects);
+    void recordException();
+
+    /** Copy the statistics words of the given byte range into data. Throws ChimeraTK::logic_error if out of range. */
+    void read(uint64_t addressInBytes, int32_t* data, size_t sizeInBytes) const;
+
+   private:
+    void add(size_t index, uint32_t value) { _words[index].fetch_add(value, std::memory_order_relaxed); }
+    void updateMax(size_t index, uint32_t value);
+    void addToHistogram(size_t index, uint32_t microseconds);
+
+    bool _isTcp;
+    std::array<std::atomic<uint32_t>, nBlocks * blockWords> _words{};
+  };
+
+} // namespace ChimeraTK
@@ -0,0 +1,58 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ChimeraTK {
+
+  /**
+   * A single Modbus request/response pair which fits into one frame.
+   *
+   * The data pointer follows the libmodbus conventions: For bit function codes it points to one uint8_t per bit, for
+   * register function codes it points to one uint16_t per register in host byte order. For write function codes the
+   * data is only read.
+   */
+  struct ModbusTransaction {
+    int function;
+    int address; // in units of the function code (registers or bits)
+    int length;  // in units of the function code (registers or bits)
+    void* data;
+  };
+
+  /**
+   * Encoding and decoding of Modbus TCP application data units (MBAP header + PDU). This is used for transfers which
+   * cannot be expressed through the lock-step request/response API of libmodbus, e.g. pipelined transactions.
+   */
+  namespace ModbusTcpFrame {
+    constexpr size_t headerLength = 7; // MBAP header: transaction id, protocol id, length, unit id
+    constexpr size_t maxLength = 260;  // same as MODBUS_TCP_MAX_ADU_LENGTH
+
+    /**
+     * Encode the request for the given transaction into the buffer, which must have at least maxLength bytes. Returns
+     * the length of the frame in bytes.
+     */
+    size_t encodeRequest(const ModbusTransaction& transaction, uint16_t transactionId, uint8_t unitId, uint8_t* buffer);
+
+    /** Extract the transaction id from the MBAP header of a received frame. */
+    uint16_t transactionId(const uint8_t* frame);
+
+    /**
+     * Total length of the frame starting with the given MBAP header (headerLength bytes), taken from its length field.
+     * Returns 0 if the header is invalid, i.e. the received byte stream is out of sync.
+     */
+    size_t frameLength(const uint8_t* header);
+
+    /**
+     * Decode the response frame for the given transaction sent to the given unit id and store received data in
+     * transaction.data. Returns the number of transferred bits/registers, or -1 with errno set to the matching
+     * libmodbus error code (EMBBADSLAVE if the response comes from a different unit).
+     *
+     * Bits are packed on the wire and are converted directly between the frame and the one-byte-per-bit buffer, so no
+     * intermediate buffer is needed.
+     */
+    int decodeResponse(const ModbusTransaction& transaction, uint8_t unitId, const uint8_t* frame, size_t frameLength);
+  } // namespace ModbusTcpFrame
+
+} // namespace ChimeraTK
@@ -0,0 +1,450 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+#include "ModbusAsyncConnection.h"
+
+#include "modbus/modbus.h"
+
+#include <ChimeraTK/Exception.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+namespace ChimeraTK {
+
+  /********************************************************************************************************************/
+
+  namespace {
+    using Clock = std::chrono::steady_clock;
+
+    // number of transaction ids of timed out requests which may stay reserved before the connection is reset
+    constexpr size_t maxExpired = 1024;
+
+    /** The I/O thread serving the sockets of all ModbusAsyncConnections. */
+    class IoThread {
+     public:
+      static IoThread& getInstance() {
+        // never destroyed, since connections might still be closed by static objects during shutdown
+        static auto* instance = new IoThread();
+        return *instance;
+      }
+
+      void add(int socket, std::weak_ptr<ModbusAsyncConnection> connection) {
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          _connections[socket] = std::move(connection);
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = socket;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, socket, &event);
+      }
+
+      void remove(int socket) {
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, socket, nullptr);
+        std::lock_guard<std::mutex> lock(_mutex);
+        _connections.erase(socket);
+      }
+
+      void watchWritable(int socket, bool watch) {
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP | (watch ? uint32_t(EPOLLOUT) : 0U);
+        event.data.fd = socket;
+        epoll_ctl(_epoll, EPOLL_CTL_MOD, socket, &event);
+      }
+
+      // make sure the thread wakes up in time for the given deadline
+      void scheduleDeadline(Clock::time_point deadline) {
+        if(lowerNextDeadline(deadline)) {
+          uint64_t one = 1;
+          [[maybe_unused]] auto rc = ::write(_eventFd, &one, sizeof(one));
+        }
+      }
+
+     private:
+      IoThread() {
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        _eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(_epoll == -1 || _eventFd == -1) {
+          throw ChimeraTK::runtime_error(std::string("ModbusBackend: Cannot create I/O thread: ") + strerror(errno));
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = _eventFd;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _eventFd, &event);
+        std::thread([this] { run(); }).detach();
+      }
+
+      void run() {
+        std::array<epoll_event, 64> events{};
+        for(;;) {
+          int timeout = -1;
+          auto nextDeadline = _nextDeadline.load();
+          if(nextDeadline != Clock::time_point::max()) {
+            // round up, so the deadline has passed when epoll_wait() returns
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(nextDeadline - Clock::now());
+            timeout = int(std::max<int64_t>(remaining.count() + 1, 0));
+          }
+          auto n = epoll_wait(_epoll, events.data(), int(events.size()), timeout);
+          if(n == -1 && errno != EINTR) {
+            // No events can be received any more. Fail the requests of all connections instead of letting them time
+            // out, and do not spin if the error persists.
+            auto error = errno;
+            for(auto& connection : lockConnections()) {
+              connection->close(error);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+          }
+
+          for(int i = 0; i < n; ++i) {
+            if(events[i].data.fd == _eventFd) {
+              uint64_t value;
+              [[maybe_unused]] auto rc = ::read(_eventFd, &value, sizeof(value));
+              continue;
+            }
+            std::shared_ptr<ModbusAsyncConnection> connection;
+            {
+              std::lock_guard<std::mutex> lock(_mutex);
+              auto entry = _connections.find(events[i].data.fd);
+              if(entry != _connections.end()) {
+                connection = entry->second.lock();
+              }
+            }
+            if(connection) {
+              connection->handleEvents(events[i].events);
+            }
+          }
+
+          // fail timed out requests of all connections and determine when to wake up next
+          auto connections = lockConnections();
+          // Reset before collecting, so deadlines of requests submitted concurrently are not lost: they are either
+          // seen by expire() or lower the next deadline afterwards.
+          _nextDeadline = Clock::time_point::max();
+          auto now = Clock::now();
+          for(auto& connection : connections) {
+            lowerNextDeadline(connection->expire(now));
+          }
+        }
+      }
+
+      // all registered connections which are still alive
+      std::vector<std::shared_ptr<ModbusAsyncConnection>> lockConnections() {
+        std::vector<std::shared_ptr<ModbusAsyncConnection>> connections;
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(auto& [socket, weak] : _connections) {
+          if(auto connection = weak.lock()) {
+            connections.push_back(std::move(connection));
+          }
+        }
+        return connections;
+      }
+
+      // returns true if the next deadline has been lowered
+      bool lowerNextDeadline(Clock::time_point deadline) {
+        auto current = _nextDeadline.load();
+        while(deadline < current) {
+          if(_nextDeadline.compare_exchange_weak(current, deadline)) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      int _epoll{-1};
+
+      // used to wake up the thread when a request with an earlier deadline has been submitted
+      int _eventFd{-1};
+
+      std::atomic<Clock::time_point> _nextDeadline{Clock::time_point::max()};
+
+      // registered connections by socket, governed by _mutex
+      std::map<int, std::weak_ptr<ModbusAsyncConnection>> _connections;
+      std::mutex _mutex;
+    };
+  } // namespace
+
+  /********************************************************************************************************************/
+
+  ModbusAsyncConnection::ModbusAsyncConnection(std::string host, std::string port)
+  : _host(std::move(host)), _port(std::move(port)) {}
+
+  /********************************************************************************************************************/
+
+  ModbusAsyncConnection::~ModbusAsyncConnection() {
+    close();
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusAsyncConnection::connect() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(_socket != -1) {
+      return;
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    auto rc = getaddrinfo(_host.c_str(), _port.c_str(), &hints, &addresses);
+    if(rc != 0) {
+      throw ChimeraTK::runtime_error("ModbusBackend: Cannot resolve " + _host + ": " + gai_strerror(rc));
+    }
+
+    int error = ECONNREFUSED;
+    for(auto* address = addresses; address != nullptr; address = address->ai_next) {
+      int socket = ::socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+      if(socket == -1) {
+        error = errno;
+        continue;
+      }
+      if(::connect(socket, address->ai_addr, address->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        error = errno;
+        ::close(socket);
+        continue;
+      }
+      // wait for the connection to be established
+      pollfd connecting{socket, POLLOUT, 0};
+      auto n = ::poll(&connecting, 1, int(_connectTimeout.count()));
+      int socketError = 0;
+      socklen_t length = sizeof(socketError);
+      if(n == 1) {
+        getsockopt(socket, SOL_SOCKET, SO_ERROR, &socketError, &length);
+      }
+      else {
+        socketError = (n == 0) ? ETIMEDOUT : errno;
+      }
+      if(socketError != 0) {
+        error = socketError;
+        ::close(socket);
+        continue;
+      }
+      // requests are small and must not be delayed
+      int one = 1;
+      setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      _socket = socket;
+      break;
+    }
+    freeaddrinfo(addresses);
+
+    if(_socket == -1) {
+      throw ChimeraTK::runtime_error(std::string("ModbusBackend: Connection failed: ") + strerror(error));
+    }
+    _waitingForWritable = false;
+    IoThread::getInstance().add(_socket, weak_from_this());
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusAsyncConnection::close(int error) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    fail(error);
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusAsyncConnection::isConnected() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _socket != -1;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusAsyncConnection::setResponseTimeout(std::chrono::milliseconds timeout) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _responseTimeout = timeout;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusAsyncConnection::setConnectTimeout(std::chrono::milliseconds timeout) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _connectTimeout = timeout;
+  }
+
+  /********************************************************************************************************************/
+
+  std::future<int> ModbusAsyncConnection::submit(const ModbusTransaction& transaction, uint8_t unitId) {
+    std::promise<int> result;
+    auto future = result.get_future();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(_socket == -1) {
+      result.set_value(-ENOTCONN);
+      return future;
+    }
+
+    // skip transaction ids which are still in use by very slow requests resp. may still receive a late response
+    while(_pending.count(_nextTransactionId) || _expired.count(_nextTransactionId)) {
+      ++_nextTransactionId;
+    }
+    auto transactionId = _nextTransactionId++;
+
+    std::array<uint8_t, ModbusTcpFrame::maxLength> frame{};
+    auto frameLength = ModbusTcpFrame::encodeRequest(transaction, transactionId, unitId, frame.data());
+    auto deadline = Clock::now() + _responseTimeout;
+    _pending[transactionId] = Request{transaction, unitId, std::move(result), deadline};
+    _sendBuffer.insert(_sendBuffer.end(), frame.begin(), frame.begin() + long(frameLength));
+
+    flushSendBuffer();
+    IoThread::getInstance().scheduleDeadline(deadline);
+    return future;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusAsyncConnection::flushSendBuffer() {
+    size_t sent = 0;
+    while(sent < _sendBuffer.size()) {
+      auto rc = ::send(_socket, _sendBuffer.data() + sent, _sendBuffer.size() - sent, MSG_NOSIGNAL);
+      if(rc >= 0) {
+        sent += size_t(rc);
+        continue;
+      }
+      if(errno == EINTR) {
+        continue;
+      }
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      fail(errno);
+      return;
+    }
+    _sendBuffer.erase(_sendBuffer.begin(), _sendBuffer.begin() + long(sent));
+
+    // let the I/O thread send the rest once the socket accepts more data
+    if(_sendBuffer.empty() == _waitingForWritable) {
+      _waitingForWritable = !_sendBuffer.empty();
+      IoThread::getInstance().watchWritable(_socket, _waitingForWritable);
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusAsyncConnection::handleEvents(uint32_t events) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(_socket == -1) {
+      // closed while the event was pending
+      return;
+    }
+
+    if(events & EPOLLOUT) {
+      flushSendBuffer();
+      if(_socket == -1) {
+        return;
+      }
+    }
+
+    if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      std::array<uint8_t, 4096> buffer{};
+      for(;;) {
+        auto n = ::recv(_socket, buffer.data(), buffer.size(), 0);
+        if(n > 0) {
+          _receiveBuffer.insert(_receiveBuffer.end(), buffer.begin(), buffer.begin() + n);
+          continue;
+        }
+        if(n == 0) {
+          fail(ECONNRESET);
+          return;
+        }
+        if(errno == EINTR) {
+          continue;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        fail(errno);
+        return;
+      }
+      processReceived();
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusAsyncConnection::processReceived() {
+    size_t offset = 0;
+    while(_receiveBuffer.size() - offset >= ModbusTcpFrame::headerLength) {
+      const auto* frame = _receiveBuffer.data() + offset;
+      auto frameLength = ModbusTcpFrame::frameLength(frame);
+      if(frameLength == 0) {
+        // cannot find the start of the next frame any more
+        fail(EMBBADDATA);
+        return;
+      }
+      if(_receiveBuffer.size() - offset < frameLength) {
+        break;
+      }
+      // late responses to timed out requests are discarded, which releases their transaction id
+      auto transactionId = ModbusTcpFrame::transactionId(frame);
+      auto request = _pending.find(transactionId);
+      if(request != _pending.end()) {
+        auto rc = ModbusTcpFrame::decodeResponse(
+            request->second.transaction, request->second.unitId, frame, frameLength);
+        request->second.result.set_value(rc == -1 ? -errno : rc);
+        _pending.erase(request);
+      }
+      else {
+        _expired.erase(transactionId);
+      }
+      offset += frameLength;
+    }
+    _receiveBuffer.erase(_receiveBuffer.begin(), _receiveBuffer.begin() + long(offset));
+  }
+
+  /********************************************************************************************************************/
+
+  Clock::time_point ModbusAsyncConnection::expire(Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto nextDeadline = Clock::time_point::max();
+    for(auto request = _pending.begin(); request != _pending.end();) {
+      if(request->second.deadline <= now) {
+        request->second.result.set_value(-ETIMEDOUT);
+        _expired.insert(request->first);
+        request = _pending.erase(request);
+        continue;
+      }
+      nextDeadline = std::min(nextDeadline, request->second.deadline);
+      ++request;
+    }
+    if(_expired.size() > maxExpired) {
+      // The device apparently drops requests. Reset the connection to release the transaction ids, otherwise they
+      // would run out eventually.
+      fail(ETIMEDOUT);
+    }
+    return nextDeadline;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusAsyncConnection::fail(int error) {
+    if(_socket != -1) {
+      IoThread::getInstance().remove(_socket);
+      ::close(_socket);
+      _socket = -1;
+    }
+    for(auto& [transactionId, request] : _pending) {
+      request.result.set_value(-error);
+    }
+    _pending.clear();
+    _expired.clear();
+    _sendBuffer.clear();
+    _receiveBuffer.clear();
+  }
+
+  /********************************************************************************************************************/
+
+} // namespace ChimeraTK
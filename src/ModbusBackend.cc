@@ -12,6 +12,15 @@
 #include <ChimeraTK/BackendFactory.h>
 #include <ChimeraTK/DeviceAccessVersion.h>
 
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <sstream>
+
 // You have to define an "extern C" function with this signature. It has to return
 // CHIMERATK_DEVICEACCESS_VERSION for version checking when the library is loaded
 // at run time. This function is used to determine that this is a valid DeviceAcces
@@ -26,6 +35,23 @@ namespace ChimeraTK {
 
   /********************************************************************************************************************/
 
+  namespace {
+    // Split a transfer into transactions which do not exceed the protocol limit maxLength. The elementSize is the size
+    // of one bit/register in the buffer.
+    std::vector<ModbusTransaction> splitIntoTransactions(
+        int function, int address, int length, int maxLength, void* data, size_t elementSize) {
+      std::vector<ModbusTransaction> transactions;
+      auto* buffer = static_cast<uint8_t*>(data);
+      for(int offset = 0; offset < length; offset += maxLength) {
+        transactions.push_back(
+            {function, address + offset, std::min(length - offset, maxLength), buffer + offset * elementSize});
+      }
+      return transactions;
+    }
+  } // namespace
+
+  /********************************************************************************************************************/
+
   ModbusBackend::BackendRegisterer ModbusBackend::gModbusBackend;
 
   ModbusBackend::BackendRegisterer::BackendRegisterer() {
@@ -37,60 +63,267 @@ namespace ChimeraTK {
 
   ModbusBackend::ModbusBackend(std::string address, ModbusType type, std::map<std::string, std::string> parameters)
   : NumericAddressedBackend(parameters["map"]), _address(std::move(address)), _parameters(std::move(parameters)),
-    _type(type) {
+    _type(type), _statistics(type == tcp) {
     _opened = false;
 
     auto disable_merging_str = _parameters.find("disableMerging");
     if(disable_merging_str != _parameters.end()) {
       _mergingEnabled = (std::stoi(disable_merging_str->second) == 0);
     }
-  }
 
-  /********************************************************************************************************************/
+    auto pipeline_window_str = _parameters.find("pipelineWindow");
+    if(pipeline_window_str != _parameters.end()) {
+      auto window = std::stoi(pipeline_window_str->second);
+      if(window < 1) {
+        throw ChimeraTK::logic_error("ModbusBackend: pipelineWindow must be at least 1.");
+      }
+      _pipelineWindow = size_t(window);
+    }
 
-  void ModbusBackend::open() {
-    std::unique_lock<std::mutex> lock(_modbus_mutex);
+    size_t nConnections = 1;
+    auto connections_str = _parameters.find("connections");
+    if(connections_str != _parameters.end()) {
+      auto n = std::stoi(connections_str->second);
+      if(n < 1) {
+        throw ChimeraTK::logic_error("ModbusBackend: connections must be at least 1.");
+      }
+      if(n > 1 && _type != tcp) {
+        throw ChimeraTK::logic_error("ModbusBackend: Multiple connections are only supported in TCP mode.");
+      }
+      nConnections = size_t(n);
+    }
 
-    if(_ctx == nullptr) {
-      if(_type == tcp) {
-        _ctx = modbus_new_tcp_pi(_address.c_str(), _parameters["port"].c_str());
+    auto transport_str = _parameters.find("transport");
+    if(transport_str != _parameters.end() && transport_str->second != "sync") {
+      if(transport_str->second != "async") {
+        throw ChimeraTK::logic_error("ModbusBackend: Unknown transport '" + transport_str->second +
+            "'. Available transports are: sync and async.");
       }
-      else {
-        _ctx = modbus_new_rtu(_address.c_str(), std::stoi(_parameters["baud"]), *_parameters["parity"].c_str(),
-            std::stoi(_parameters["databits"]), std::stoi(_parameters["stopbits"]));
+      if(_type != tcp) {
+        throw ChimeraTK::logic_error("ModbusBackend: The async transport is only supported in TCP mode.");
       }
-      if(_ctx == nullptr) {
-        throw ChimeraTK::logic_error(
-            std::string("ModbusBackend: Unable to create libmodbus context: ") + modbus_strerror(errno));
+      if(nConnections > 1) {
+        throw ChimeraTK::logic_error("ModbusBackend: The async transport does not support multiple connections.");
+      }
+      if(_parameters.count("reconnect") && std::stoi(_parameters["reconnect"]) != 0) {
+        throw ChimeraTK::logic_error("ModbusBackend: The async transport does not support reconnect.");
+      }
+    }
+
+    auto keep_open_str = _parameters.find("keepOpenOnException");
+    if(keep_open_str != _parameters.end()) {
+      _keepOpenOnException = (std::stoi(keep_open_str->second) != 0);
+    }
+
+    // the slave id is selected per transaction, so several backends can share one bus
+    _slaveId = std::stoi(_parameters["slaveid"]);
+    if(_slaveId < 0 || _slaveId > (_type == tcp ? 255 : 247)) {
+      throw ChimeraTK::logic_error("ModbusBackend: Invalid slave ID " + _parameters["slaveid"] + ".");
+    }
+    _bus = ModbusBus::get(_type, _address, _parameters, nConnections);
+
+    // tell the merge planner which address ranges are mapped in the map file
+    _planner = ModbusMergePlanner(_type == tcp, _parameters);
+    for(const auto& info : _registerMap) {
+      if(info.bar == ModbusStatistics::bar) {
+        // the statistics registers are added below, the bar is not available to the map file
+        throw ChimeraTK::logic_error("ModbusBackend: Register " + std::string(info.pathName) + " uses bar " +
+            std::to_string(ModbusStatistics::bar) + ", which is reserved for the statistics.");
+      }
+      if(!barIndexValid(info.bar)) {
+        continue;
+      }
+      auto sizeInBytes = (uint64_t(info.nElements) * info.elementPitchBits + 7) / 8;
+      ModbusAddressRange range{int(info.address), int(info.address + sizeInBytes)};
+      if(info.bar == 3 || info.bar == 4) {
+        range = {int(info.address / 2), int((info.address + sizeInBytes + 1) / 2)};
+      }
+      if(_planner.containsForbidden(info.bar, range)) {
+        throw ChimeraTK::logic_error("ModbusBackend: Register " + std::string(info.pathName) +
+            " overlaps with forbiddenRanges.");
+      }
+      _planner.addMappedRange(info.bar, range);
+    }
+
+    // configure the poll groups: pollPeriods=<interrupt>:<period in ms>,...
+    auto poll_periods_str = _parameters.find("pollPeriods");
+    if(poll_periods_str != _parameters.end()) {
+      std::stringstream list(poll_periods_str->second);
+      std::string entry;
+      while(std::getline(list, entry, ',')) {
+        uint32_t interrupt;
+        char colon;
+        int64_t period;
+        std::stringstream entryStream(entry);
+        if(!(entryStream >> interrupt >> colon >> period) || colon != ':' || period <= 0) {
+          throw ChimeraTK::logic_error("ModbusBackend: Cannot parse pollPeriods entry '" + entry + "'.");
+        }
+        _pollGroups[interrupt].period = std::chrono::milliseconds(period);
+      }
+    }
+    for(const auto& info : _registerMap) {
+      if(info.interruptId.empty() || !barIndexValid(info.bar)) {
+        continue;
+      }
+      auto group = _pollGroups.find(uint32_t(info.interruptId.front()));
+      if(group == _pollGroups.end()) {
+        continue;
       }
-      if(modbus_set_slave(_ctx, std::stoi(_parameters["slaveid"])) < 0) {
-        throw ChimeraTK::logic_error(std::string("ModbusBackend: Set slave ID failed: ") + modbus_strerror(errno));
+      auto sizeInBytes = (uint64_t(info.nElements) * info.elementPitchBits + 7) / 8;
+      auto elementSize = (info.bar >= 3) ? 2 : 1;
+      group->second.ranges[info.bar].push_back({int(info.address / elementSize),
+          int((info.address + sizeInBytes + elementSize - 1) / elementSize)});
+    }
+
+    auto poll_only_changed_str = _parameters.find("pollOnlyChanged");
+    if(poll_only_changed_str != _parameters.end()) {
+      _pollOnlyChanged = (std::stoi(poll_only_changed_str->second) != 0);
+    }
+
+    // shadow cache for the read-only bars: the planned blocks are cut into frame-sized pieces, so a cache miss does
+    // not cost more frames than a direct read
+    auto cache_max_age_str = _parameters.find("cacheMaxAge");
+    if(cache_max_age_str != _parameters.end()) {
+      _cacheMaxAge = std::chrono::milliseconds(std::stoi(cache_max_age_str->second));
+    }
+    if(_cacheMaxAge.count() > 0) {
+      for(uint64_t bar : {1, 4}) {
+        int maxLength = (bar == 4) ? MODBUS_MAX_READ_REGISTERS : MODBUS_MAX_READ_BITS;
+        for(const auto& block : _planner.blocks(bar)) {
+          for(int begin = block.begin; begin < block.end; begin += maxLength) {
+            _cache.push_back({bar, {begin, std::min(begin + maxLength, block.end)}, {}, {}, false, false});
+          }
+        }
       }
-      if(modbus_connect(_ctx) == -1) {
-        // If server cannot be reached, errors ECONNREFUSED and EINPROGRESS might alternate. This will create
-        // many log messages e.g. in ApplicationCore and hence is here "filtered". EINPROGRESS is anyway a bit
-        // misleading in this context and hence is replaced with ECONNREFUSED.
-        auto error = errno;
-        if(error == EINPROGRESS) {
-          error = ECONNREFUSED;
+    }
+
+    // byte order of multi-register values: byteOrder=<range>:<order>,... where range is either a register name or
+    // <bar>:<first>-<last> with inclusive map file addresses
+    auto byte_order_str = _parameters.find("byteOrder");
+    if(byte_order_str != _parameters.end()) {
+      std::stringstream list(byte_order_str->second);
+      std::string entry;
+      while(std::getline(list, entry, ',')) {
+        auto separator = entry.rfind(':');
+        if(separator == std::string::npos) {
+          throw ChimeraTK::logic_error("ModbusBackend: Cannot parse byteOrder entry '" + entry + "'.");
+        }
+        ByteOrderRange range{0, {}, ModbusByteOrder::parse(entry.substr(separator + 1))};
+        auto target = entry.substr(0, separator);
+        if(!target.empty() && std::isdigit(static_cast<unsigned char>(target.front()))) {
+          uint64_t first;
+          uint64_t last;
+          char colon;
+          char dash;
+          std::stringstream targetStream(target);
+          if(!(targetStream >> range.bar >> colon >> first >> dash >> last) || colon != ':' || dash != '-' ||
+              last < first) {
+            throw ChimeraTK::logic_error("ModbusBackend: Cannot parse byteOrder entry '" + entry + "'.");
+          }
+          range.range = {int(first / 2), int(last / 2) + 1};
+        }
+        else {
+          // register name as in the map file, e.g. holding.reg32
+          std::string path = target;
+          std::replace(path.begin(), path.end(), '.', '/');
+          if(path.empty() || path.front() != '/') {
+            path = "/" + path;
+          }
+          bool found = false;
+          for(const auto& info : _registerMap) {
+            if(std::string(info.pathName) == path) {
+              auto sizeInBytes = (uint64_t(info.nElements) * info.elementPitchBits + 7) / 8;
+              range.bar = info.bar;
+              range.range = {int(info.address / 2), int((info.address + sizeInBytes + 1) / 2)};
+              found = true;
+              break;
+            }
+          }
+          if(!found) {
+            throw ChimeraTK::logic_error("ModbusBackend: Unknown register '" + target + "' in byteOrder.");
+          }
         }
-        auto message = std::string("ModbusBackend: Connection failed: ") + modbus_strerror(error);
-        lock.unlock();
-        setException(message);
-        closeConnection();
-        throw ChimeraTK::runtime_error(message);
+        if(range.bar != 3 && range.bar != 4) {
+          throw ChimeraTK::logic_error("ModbusBackend: byteOrder can only be set for registers (bars 3 and 4).");
+        }
+        if(range.order.needsConversion()) {
+          _byteOrders.push_back(range);
+        }
+      }
+    }
+
+    // write-behind buffer for coils and holding registers
+    auto write_behind_str = _parameters.find("writeBehind");
+    if(write_behind_str != _parameters.end()) {
+      _writeBehind = std::chrono::milliseconds(std::stoi(write_behind_str->second));
+      if(_writeBehind.count() < 0) {
+        throw ChimeraTK::logic_error("ModbusBackend: writeBehind must not be negative.");
+      }
+    }
+    auto write_behind_max_size_str = _parameters.find("writeBehindMaxSize");
+    if(write_behind_max_size_str != _parameters.end()) {
+      auto maxSize = std::stoi(write_behind_max_size_str->second);
+      if(maxSize < 1) {
+        throw ChimeraTK::logic_error("ModbusBackend: writeBehindMaxSize must be at least 1.");
       }
+      _writeBehindMaxSize = size_t(maxSize);
+    }
+
+    // the statistics are always available as read-only registers in the virtual bar
+    for(const auto& description : ModbusStatistics::describeRegisters()) {
+      _registerMap.addRegister(NumericAddressedRegisterInfo("/Statistics/" + description.name, description.nElements,
+          description.address, description.nElements * 4, ModbusStatistics::bar, 32, 0, false,
+          NumericAddressedRegisterInfo::Access::READ_ONLY));
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::open() {
+    // connections which are already established by other slaves on the same bus are kept
+    try {
+      _statistics.recordConnects(_bus->open(this));
+    }
+    catch(ChimeraTK::runtime_error& ex) {
+      setException(ex.what());
+      closeConnection();
+      throw;
     }
     setOpenedAndClearException();
 
-    lock.unlock();
+    if(_writeBehind.count() > 0 && !_writeBehindThread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(_writeBufferMutex);
+        _writeBehindShutdown = false;
+      }
+      _writeBehindThread = std::thread([this] { writeBehindThread(); });
+    }
+
+    {
+      // resume polling after close()
+      std::lock_guard<std::mutex> lock(_pollMutex);
+      auto anyActive = std::any_of(_pollGroups.begin(), _pollGroups.end(), [](auto& g) { return g.second.active; });
+      if(anyActive && !_pollerThread.joinable()) {
+        _pollerShutdown = false;
+        _pollerThread = std::thread([this] { pollerThread(); });
+      }
+    }
 
-    // verify connection is ok again with a dummy read of the address which failed last.
-    if(_lastFailedAddress.has_value()) {
+    // verify connection is ok again with a dummy read of the address which failed last. This is done on each pooled
+    // connection, since all of them might have been re-established.
+    auto lastFailedAddress = getLastFailedAddress();
+    if(lastFailedAddress.has_value()) {
       int32_t temp;
-      size_t dummyReadSize = _lastFailedAddress->first <= 1 ? 1 : 2; // depends on bar
+      size_t dummyReadSize = lastFailedAddress->first <= 1 ? 1 : 2; // depends on bar
       try {
-        read(_lastFailedAddress->first, _lastFailedAddress->second, &temp, dummyReadSize);
+        if(_bus->asyncConnection() != nullptr) {
+          readDevice(lastFailedAddress->first, lastFailedAddress->second, &temp, dummyReadSize);
+        }
+        for(size_t i = 0; i < _bus->nConnections(); ++i) {
+          ModbusBus::Lock lock;
+          auto& connection = _bus->acquire(i, _slaveId, lock);
+          readImpl(connection, lastFailedAddress->first, lastFailedAddress->second, &temp, dummyReadSize);
+        }
       }
       catch(ChimeraTK::runtime_error& ex) {
         setException(ex.what());
@@ -102,21 +335,47 @@ namespace ChimeraTK {
   /********************************************************************************************************************/
 
   void ModbusBackend::closeImpl() {
+    stopPoller();
+    if(_writeBehindThread.joinable()) {
+      // write the pending data. Errors cannot be reported any more at this point.
+      if(_opened && isFunctional()) {
+        try {
+          flushWriteBuffer();
+        }
+        catch(ChimeraTK::runtime_error&) {
+        }
+      }
+      stopWriteBehind();
+    }
+    invalidateCache();
     if(_opened) {
       _opened = false;
-      closeConnection();
+      _bus->close(this);
     }
   }
 
   /********************************************************************************************************************/
 
   void ModbusBackend::closeConnection() {
-    std::lock_guard<std::mutex> lock(_modbus_mutex);
-    if(_ctx != nullptr) {
-      modbus_close(_ctx);
-      modbus_free(_ctx);
-      _ctx = nullptr;
+    // Other slaves on the same bus continue to use the connections, unless the connection itself has failed. The
+    // same applies to a single slave if configured, so the connection survives exception responses.
+    auto isShared = _bus->isOpenByOthers(this);
+    _bus->closeConnections(isShared || _keepOpenOnException);
+  }
+
+  /********************************************************************************************************************/
+
+  ModbusBackend::Connection& ModbusBackend::acquireConnection(ConnectionLock& lock, ModbusLane lane) {
+    auto start = std::chrono::steady_clock::now();
+    auto& connection = _bus->acquire(_slaveId, lock.lock, lane);
+    lock.lockedAt = std::chrono::steady_clock::now();
+    _statistics.recordLockWait(lock.lockedAt - start);
+    checkActiveException();
+    if(connection.ctx == nullptr) {
+      // closed after a connection error seen by another slave on the same bus
+      throw ChimeraTK::runtime_error("ModbusBackend: Connection to " + _address + " has been lost.");
     }
+    return connection;
   }
 
   /********************************************************************************************************************/
@@ -125,6 +384,9 @@ namespace ChimeraTK {
     if(bar == 3 || bar == 4) {
       return 2;
     }
+    if(bar == ModbusStatistics::bar) {
+      return 4;
+    }
     return 1;
   }
 
@@ -184,16 +446,62 @@ namespace ChimeraTK {
     if(addressInBytes > size_t(std::numeric_limits<int>::max())) {
       throw ChimeraTK::logic_error("Requested read address exceeds maximum.");
     }
-    auto address = static_cast<int>(addressInBytes);
 
     if(sizeInBytes > size_t(std::numeric_limits<int>::max())) {
       throw ChimeraTK::logic_error("Requested read length exceeds maximum.");
     }
-    auto length = static_cast<int>(sizeInBytes);
 
-    std::lock_guard<std::mutex> lock(_modbus_mutex);
+    if(bar == ModbusStatistics::bar) {
+      // served from memory, also while the device is in exception state
+      _statistics.read(addressInBytes, data, sizeInBytes);
+      return;
+    }
+
+    // the snapshot holds the data in device byte order, so it is converted like data freshly read from the device
+    if(_snapshotThread != std::this_thread::get_id() || !readFromSnapshot(bar, addressInBytes, data, sizeInBytes)) {
+      readRaw(bar, addressInBytes, data, sizeInBytes);
+    }
+    applyByteOrder(bar, addressInBytes, data, sizeInBytes);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::readRaw(uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes) {
+    flushOverlapping(bar, addressInBytes, sizeInBytes);
+    if(!_cache.empty() && (bar == 1 || bar == 4) && readFromCache(bar, addressInBytes, data, sizeInBytes)) {
+      return;
+    }
+    readDevice(bar, addressInBytes, data, sizeInBytes);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::readDevice(uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes) {
+    if(_bus->asyncConnection() != nullptr) {
+      checkActiveException();
+      transferAsync(readTransactions(bar, addressInBytes, data, sizeInBytes), bar, addressInBytes, false);
+      return;
+    }
+    ConnectionLock lock(_statistics);
+    auto& connection = acquireConnection(lock);
+    readImpl(connection, bar, addressInBytes, data, sizeInBytes);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::readImpl(
+      Connection& connection, uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes) {
     checkActiveException();
-    assert(_ctx != nullptr);
+    assert(connection.ctx != nullptr);
+    transfer(connection, readTransactions(bar, addressInBytes, data, sizeInBytes), bar, addressInBytes, false);
+  }
+
+  /********************************************************************************************************************/
+
+  std::vector<ModbusTransaction> ModbusBackend::readTransactions(
+      uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes) {
+    auto address = static_cast<int>(addressInBytes);
+    auto length = static_cast<int>(sizeInBytes);
 
     if(bar == 3 || bar == 4) {
       assert(address % 2 == 0); // guaranteed via minimumTransferAlignment()
@@ -205,49 +513,31 @@ namespace ChimeraTK {
       length = 1;
     }
 
-    constexpr int nMaxTransferWords = 125; // limitation of Modbus protocol
-
-    int rc;
-    if(bar == 0) {
-      auto* t = static_cast<uint8_t*>(static_cast<void*>(data));
-      rc = modbus_read_bits(_ctx, address, length, t);
-      checkErrorAndThrow(rc, length, bar, addressInBytes, false);
-    }
-    else if(bar == 1) {
-      auto* t = static_cast<uint8_t*>(static_cast<void*>(data));
-      rc = modbus_read_input_bits(_ctx, address, length, t);
-      checkErrorAndThrow(rc, length, bar, addressInBytes, false);
-    }
-    else if(bar == 3) {
-      auto addressEnd = address + length; // points to _after_ the end
-      auto* t16 = static_cast<uint16_t*>(static_cast<void*>(data));
-      while(address < addressEnd) {
-        auto lengthActual = std::min(addressEnd - address, nMaxTransferWords);
-
-        rc = modbus_read_registers(_ctx, address, lengthActual, t16);
-        checkErrorAndThrow(rc, lengthActual, bar, addressInBytes, false);
-
-        address += nMaxTransferWords;
-        t16 += nMaxTransferWords;
-      }
+    int function;
+    int maxLength;
+    size_t elementSize;
+    if(bar == 0 || bar == 1) {
+      function = (bar == 0) ? MODBUS_FC_READ_COILS : MODBUS_FC_READ_DISCRETE_INPUTS;
+      maxLength = MODBUS_MAX_READ_BITS;
+      elementSize = 1;
     }
-    else if(bar == 4) {
-      auto addressEnd = address + length; // points to _after_ the end
-      auto* t16 = static_cast<uint16_t*>(static_cast<void*>(data));
-      while(address < addressEnd) {
-        auto lengthActual = std::min(addressEnd - address, nMaxTransferWords);
-
-        rc = modbus_read_input_registers(_ctx, address, lengthActual, t16);
-        checkErrorAndThrow(rc, lengthActual, bar, addressInBytes, false);
-
-        address += nMaxTransferWords;
-        t16 += nMaxTransferWords;
-      }
+    else if(bar == 3 || bar == 4) {
+      function = (bar == 3) ? MODBUS_FC_READ_HOLDING_REGISTERS : MODBUS_FC_READ_INPUT_REGISTERS;
+      maxLength = MODBUS_MAX_READ_REGISTERS;
+      elementSize = 2;
     }
     else {
       throw ChimeraTK::logic_error(
           "Bar number " + std::to_string((int)bar) + " is not supported by the ModbusBackend.");
     }
+
+    // mapped registers never overlap forbidden addresses (checked in the constructor), but raw numeric addressing can
+    if(_planner.containsForbidden(bar, {address, address + length})) {
+      throw ChimeraTK::logic_error("ModbusBackend: Read of bar " + std::to_string(bar) + " at address " +
+          std::to_string(address) + " with length " + std::to_string(length) + " touches forbiddenRanges.");
+    }
+
+    return splitIntoTransactions(function, address, length, maxLength, data, elementSize);
   }
 
   /********************************************************************************************************************/
@@ -256,17 +546,47 @@ namespace ChimeraTK {
     if(addressInBytes > size_t(std::numeric_limits<int>::max())) {
       throw ChimeraTK::logic_error("Requested write address exceeds maximum.");
     }
-    auto address = static_cast<int>(addressInBytes);
 
     if(sizeInBytes > size_t(std::numeric_limits<int>::max())) {
       throw ChimeraTK::logic_error("Requested write length exceeds maximum.");
     }
-    auto length = static_cast<int>(sizeInBytes);
 
-    std::lock_guard<std::mutex> lock(_modbus_mutex);
-    checkActiveException();
-    assert(_ctx != nullptr);
+    // convert a copy into the device byte order, the caller's buffer must not be modified
+    std::vector<int32_t> converted;
+    if(!_byteOrders.empty()) {
+      converted.assign(data, data + (sizeInBytes + 3) / 4);
+      if(applyByteOrder(bar, addressInBytes, converted.data(), sizeInBytes)) {
+        data = converted.data();
+      }
+    }
+
+    if(_writeBehind.count() > 0 && (bar == 0 || bar == 3)) {
+      checkActiveException();
+      bufferWrite(bar, addressInBytes, data, sizeInBytes);
+      return;
+    }
+    writeDevice(bar, addressInBytes, data, sizeInBytes);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::writeDevice(uint64_t bar, uint64_t addressInBytes, int32_t const* data, size_t sizeInBytes) {
+    auto transactions =
+        writeTransactions(bar, static_cast<int>(addressInBytes), static_cast<int>(sizeInBytes), data);
+    if(_bus->asyncConnection() != nullptr) {
+      checkActiveException();
+      transferAsync(transactions, bar, addressInBytes, true);
+      return;
+    }
+    ConnectionLock lock(_statistics);
+    auto& connection = acquireConnection(lock, ModbusLane::urgent);
+    transfer(connection, transactions, bar, addressInBytes, true);
+  }
 
+  /********************************************************************************************************************/
+
+  std::vector<ModbusTransaction> ModbusBackend::writeTransactions(
+      uint64_t bar, int address, int length, int32_t const* data) {
     if(bar == 3) {
       assert(address % 2 == 0); // guaranteed via minimumTransferAlignment()
       assert(length % 2 == 0);
@@ -277,60 +597,900 @@ namespace ChimeraTK {
       length = 1;
     }
 
-    int rc;
+    // the transaction data is only read for write function codes
+    auto* rawData = const_cast<int32_t*>(data); // NOLINT(cppcoreguidelines-pro-type-const-cast)
+
+    std::vector<ModbusTransaction> transactions;
     if(bar == 0) {
       if(length == 1) {
-        rc = modbus_write_bit(_ctx, address, *(static_cast<const uint8_t*>(static_cast<const void*>(data))));
+        transactions.push_back({MODBUS_FC_WRITE_SINGLE_COIL, address, 1, rawData});
       }
       else {
-        rc = modbus_write_bits(_ctx, address, length, static_cast<const uint8_t*>(static_cast<const void*>(data)));
+        transactions =
+            splitIntoTransactions(MODBUS_FC_WRITE_MULTIPLE_COILS, address, length, MODBUS_MAX_WRITE_BITS, rawData, 1);
       }
     }
     else if(bar == 3) {
       if(length == 1) {
-        rc = modbus_write_register(_ctx, address, *(static_cast<const uint16_t*>(static_cast<const void*>(data))));
+        transactions.push_back({MODBUS_FC_WRITE_SINGLE_REGISTER, address, 1, rawData});
       }
       else {
-        rc =
-            modbus_write_registers(_ctx, address, length, static_cast<const uint16_t*>(static_cast<const void*>(data)));
+        transactions = splitIntoTransactions(
+            MODBUS_FC_WRITE_MULTIPLE_REGISTERS, address, length, MODBUS_MAX_WRITE_REGISTERS, rawData, 2);
       }
     }
     else {
       throw ChimeraTK::runtime_error(
           "Writing bar number " + std::to_string((int)bar) + " is not supported by the ModbusBackend.");
     }
+    return transactions;
+  }
+
+  /********************************************************************************************************************/
 
-    checkErrorAndThrow(rc, length, bar, addressInBytes, true);
+  void ModbusBackend::writeAndRead(uint64_t writeAddressInBytes, int32_t const* writeData, size_t writeSizeInBytes,
+      uint64_t readAddressInBytes, int32_t* readData, size_t readSizeInBytes) {
+    if(writeAddressInBytes % 2 != 0 || writeSizeInBytes % 2 != 0 || readAddressInBytes % 2 != 0 ||
+        readSizeInBytes % 2 != 0) {
+      throw ChimeraTK::logic_error("ModbusBackend: writeAndRead() requires 16 bit aligned addresses and sizes.");
+    }
+    if(writeSizeInBytes == 0 || writeSizeInBytes > 2 * MODBUS_MAX_WR_WRITE_REGISTERS || readSizeInBytes == 0 ||
+        readSizeInBytes > 2 * MODBUS_MAX_WR_READ_REGISTERS) {
+      throw ChimeraTK::logic_error("ModbusBackend: writeAndRead() size exceeds the limits of function code 23.");
+    }
+    if(std::max(writeAddressInBytes, readAddressInBytes) > size_t(std::numeric_limits<int>::max())) {
+      throw ChimeraTK::logic_error("Requested writeAndRead address exceeds maximum.");
+    }
+    if(_bus->asyncConnection() != nullptr) {
+      throw ChimeraTK::logic_error("ModbusBackend: writeAndRead() is not supported by the async transport.");
+    }
+    if(!_opened) {
+      throw ChimeraTK::logic_error("ModbusBackend: writeAndRead() called on a closed device.");
+    }
+    checkActiveException();
+
+    auto writeAddress = static_cast<int>(writeAddressInBytes / 2);
+    auto writeLength = static_cast<int>(writeSizeInBytes / 2);
+    ModbusTransaction readTransaction{MODBUS_FC_WRITE_AND_READ_REGISTERS, static_cast<int>(readAddressInBytes / 2),
+        static_cast<int>(readSizeInBytes / 2), readData};
+
+    // buffered writes of these registers must reach the device first
+    flushOverlapping(3, writeAddressInBytes, writeSizeInBytes);
+    flushOverlapping(3, readAddressInBytes, readSizeInBytes);
+
+    std::vector<int32_t> converted;
+    if(!_byteOrders.empty()) {
+      converted.assign(writeData, writeData + (writeSizeInBytes + 3) / 4);
+      if(applyByteOrder(3, writeAddressInBytes, converted.data(), writeSizeInBytes)) {
+        writeData = converted.data();
+      }
+    }
+
+    try {
+      ConnectionLock lock(_statistics);
+      auto& connection = acquireConnection(lock, ModbusLane::urgent);
+
+      auto start = std::chrono::steady_clock::now();
+      auto rc = modbus_write_and_read_registers(connection.ctx, writeAddress, writeLength,
+          static_cast<const uint16_t*>(static_cast<const void*>(writeData)), readTransaction.address,
+          readTransaction.length, static_cast<uint16_t*>(readTransaction.data));
+      auto latency = std::chrono::steady_clock::now() - start;
+      _statistics.recordTransaction(MODBUS_FC_WRITE_AND_READ_REGISTERS, 10 + 2 * size_t(writeLength),
+          2 + 2 * size_t(readTransaction.length), rc == readTransaction.length, latency);
+      if(rc != readTransaction.length) {
+        // The device executes the write before the read, but a failed response does not tell which part has failed.
+        // Hence both parts are reported with their own address, and the write may or may not have been applied.
+        auto modbusError = handleFailedTransaction(rc, &connection, readTransaction, 3);
+        throw ChimeraTK::runtime_error("ModbusBackend failed writing address (3," +
+            std::to_string(writeAddressInBytes) + ") length " + std::to_string(writeLength) +
+            " and reading address (3," + std::to_string(readAddressInBytes) + ") length " +
+            std::to_string(readTransaction.length) + " in one transaction: " + modbusError +
+            "; unknown whether written");
+      }
+    }
+    catch(ChimeraTK::runtime_error& ex) {
+      // There is no accessor which would report the exception to the backend, hence do it here. The connection lock
+      // must be released at this point, since setException() closes all connections.
+      setException(ex.what());
+      throw;
+    }
+    applyByteOrder(3, readAddressInBytes, readData, readSizeInBytes);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::flush() {
+    if(!_opened) {
+      throw ChimeraTK::logic_error("ModbusBackend: flush() called on a closed device.");
+    }
+    checkActiveException();
+    try {
+      flushWriteBuffer();
+    }
+    catch(ChimeraTK::runtime_error& ex) {
+      // there is no accessor which would report the exception to the backend
+      setException(ex.what());
+      throw;
+    }
   }
 
   /********************************************************************************************************************/
 
-  void ModbusBackend::checkErrorAndThrow(int rc, int length, uint64_t bar, uint64_t addressInBytes, bool isWrite) {
-    if(rc != length) {
-      _lastFailedAddress = {bar, addressInBytes};
-      std::string modbusError;
-      if(rc == -1) {
-        modbusError = modbus_strerror(errno);
+  void ModbusBackend::bufferWrite(uint64_t bar, uint64_t addressInBytes, int32_t const* data, size_t sizeInBytes) {
+    const auto* bytes = static_cast<const uint8_t*>(static_cast<const void*>(data));
+    bool full;
+    {
+      std::lock_guard<std::mutex> lock(_writeBufferMutex);
+      if(_writeBufferSize == 0) {
+        _writeBufferDeadline = std::chrono::steady_clock::now() + _writeBehind;
+        _writeBufferCondition.notify_all();
+      }
+      // later writes to the same address replace the buffered value
+      auto& values = _writeBuffer[bar];
+      auto sizeBefore = values.size();
+      if(bar == 3) {
+        for(size_t i = 0; i < sizeInBytes / 2; ++i) {
+          uint16_t value;
+          std::memcpy(&value, bytes + 2 * i, 2);
+          values[int(addressInBytes / 2 + i)] = value;
+        }
       }
       else {
-        modbusError = "Not all registers were transferred.";
+        for(size_t i = 0; i < sizeInBytes; ++i) {
+          values[int(addressInBytes + i)] = bytes[i];
+        }
+      }
+      _writeBufferSize += values.size() - sizeBefore;
+      full = _writeBufferSize >= _writeBehindMaxSize;
+    }
+    if(full) {
+      flushWriteBuffer();
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::flushWriteBuffer() {
+    std::lock_guard<std::mutex> flushLock(_flushMutex);
+    std::map<uint64_t, std::map<int, uint16_t>> buffer;
+    {
+      std::lock_guard<std::mutex> lock(_writeBufferMutex);
+      buffer.swap(_writeBuffer);
+      _writeBufferSize = 0;
+    }
+
+    // Only consecutive addresses are merged. Unlike for reads, gaps cannot be bridged, since this would overwrite
+    // registers which have not been written by the application.
+    struct Run {
+      uint64_t bar;
+      int begin;
+      std::vector<uint16_t> values;
+    };
+    std::vector<Run> runs;
+    for(const auto& [bar, values] : buffer) {
+      for(const auto& [address, value] : values) {
+        if(runs.empty() || runs.back().bar != bar || runs.back().begin + int(runs.back().values.size()) != address) {
+          runs.push_back({bar, address, {}});
+        }
+        runs.back().values.push_back(value);
+      }
+    }
+
+    auto describe = [](const Run& run) {
+      return (run.bar == 3 ? "registers " : "coils ") + std::to_string(run.begin) + "-" +
+          std::to_string(run.begin + int(run.values.size()) - 1);
+    };
+    for(size_t i = 0; i < runs.size(); ++i) {
+      const auto& run = runs[i];
+      size_t sizeInBytes = run.values.size() * (run.bar == 3 ? 2 : 1);
+      std::vector<int32_t> data((sizeInBytes + 3) / 4);
+      auto* bytes = static_cast<uint8_t*>(static_cast<void*>(data.data()));
+      if(run.bar == 3) {
+        std::memcpy(bytes, run.values.data(), sizeInBytes);
+      }
+      else {
+        std::transform(run.values.begin(), run.values.end(), bytes, [](uint16_t v) { return uint8_t(v); });
+      }
+      try {
+        writeDevice(run.bar, uint64_t(run.begin) * (run.bar == 3 ? 2 : 1), data.data(), sizeInBytes);
+      }
+      catch(ChimeraTK::runtime_error& ex) {
+        std::string notWritten;
+        for(size_t j = i + 1; j < runs.size(); ++j) {
+          notWritten += (notWritten.empty() ? "" : ", ") + describe(runs[j]);
+        }
+        throw ChimeraTK::runtime_error("ModbusBackend: Flushing the write-behind buffer failed for Modbus " +
+            describe(run) + " (" + ex.what() + ")" +
+            (notWritten.empty() ? "; all other ranges have been written" : "; not written: " + notWritten));
+      }
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::flushOverlapping(uint64_t bar, uint64_t addressInBytes, size_t sizeInBytes) {
+    if(_writeBehind.count() == 0 || (bar != 0 && bar != 3)) {
+      return;
+    }
+    {
+      // wait for a flush in progress, its data is no longer in the buffer
+      std::lock_guard<std::mutex> flushLock(_flushMutex);
+      std::lock_guard<std::mutex> lock(_writeBufferMutex);
+      auto values = _writeBuffer.find(bar);
+      if(values == _writeBuffer.end()) {
+        return;
+      }
+      auto elementSize = (bar == 3) ? 2 : 1;
+      auto begin = int(addressInBytes / elementSize);
+      auto end = std::max(int((addressInBytes + sizeInBytes + elementSize - 1) / elementSize), begin + 1);
+      auto first = values->second.lower_bound(begin);
+      if(first == values->second.end() || first->first >= end) {
+        return;
+      }
+    }
+    flushWriteBuffer();
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::writeBehindThread() {
+    std::unique_lock<std::mutex> lock(_writeBufferMutex);
+    while(!_writeBehindShutdown) {
+      if(_writeBufferSize == 0) {
+        _writeBufferCondition.wait(lock);
+        continue;
+      }
+      if(std::chrono::steady_clock::now() < _writeBufferDeadline) {
+        _writeBufferCondition.wait_until(lock, _writeBufferDeadline);
+        continue;
+      }
+      lock.unlock();
+      try {
+        flushWriteBuffer();
+      }
+      catch(ChimeraTK::runtime_error& ex) {
+        setException(ex.what());
+      }
+      lock.lock();
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::stopWriteBehind() {
+    {
+      std::lock_guard<std::mutex> lock(_writeBufferMutex);
+      _writeBehindShutdown = true;
+      _writeBuffer.clear();
+      _writeBufferSize = 0;
+    }
+    _writeBufferCondition.notify_all();
+    if(_writeBehindThread.joinable()) {
+      _writeBehindThread.join();
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusBackend::applyByteOrder(uint64_t bar, uint64_t addressInBytes, void* data, size_t sizeInBytes) const {
+    if(_byteOrders.empty() || (bar != 3 && bar != 4)) {
+      return false;
+    }
+    auto begin = int(addressInBytes / 2);
+    auto end = begin + int(sizeInBytes / 2);
+    bool applied = false;
+    for(const auto& entry : _byteOrders) {
+      if(entry.bar != bar) {
+        continue;
+      }
+      // values are aligned to the start of the range, partially transferred values are left alone
+      auto words = int(entry.order.wordsPerValue());
+      auto first = std::max(begin, entry.range.begin);
+      first = entry.range.begin + (first - entry.range.begin + words - 1) / words * words;
+      auto nValues = (std::min(end, entry.range.end) - first) / words;
+      if(nValues <= 0) {
+        continue;
+      }
+      entry.order.apply(static_cast<uint8_t*>(data) + 2 * (first - begin), size_t(nValues));
+      applied = true;
+    }
+    return applied;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::transfer(Connection& connection, const std::vector<ModbusTransaction>& transactions,
+      uint64_t bar, uint64_t addressInBytes, bool isWrite) {
+    if(_type == tcp && _pipelineWindow > 1 && transactions.size() > 1) {
+      transferPipelined(connection, transactions, bar, addressInBytes, isWrite);
+      return;
+    }
+    std::vector<bool> completed(transactions.size(), false);
+    for(size_t i = 0; i < transactions.size(); ++i) {
+      auto start = std::chrono::steady_clock::now();
+      auto rc = transferSingle(connection, transactions[i]);
+      _statistics.recordTransaction(
+          transactions[i], rc == transactions[i].length, std::chrono::steady_clock::now() - start);
+      if(rc != transactions[i].length) {
+        checkErrorAndThrow(rc, &connection, transactions[i], bar, addressInBytes, isWrite,
+            describeCompleted(transactions, completed, bar));
+      }
+      completed[i] = true;
+
+      // Let queued writes pass between the frames of a long read. Another slave might have used the connection.
+      if(!isWrite && i + 1 < transactions.size() && connection.mutex.yieldToUrgent()) {
+        checkActiveException();
+        if(connection.broken || connection.ctx == nullptr) {
+          // the write has failed, the stream is out of sync resp. closed
+          _statistics.recordException();
+          auto completedTransactions = describeCompleted(transactions, completed, bar);
+          throw ChimeraTK::runtime_error("ModbusBackend failed reading address (" + std::to_string(bar) + "," +
+              std::to_string(addressInBytes) + "): connection lost while the read was paused for a write" +
+              (completedTransactions.empty() ? "" : "; already read (Modbus addresses): " + completedTransactions));
+        }
+        modbus_set_slave(connection.ctx, _slaveId);
+      }
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  int ModbusBackend::transferSingle(Connection& connection, const ModbusTransaction& transaction) {
+    switch(transaction.function) {
+      case MODBUS_FC_READ_COILS:
+        return modbus_read_bits(connection.ctx, transaction.address, transaction.length,
+            static_cast<uint8_t*>(transaction.data));
+      case MODBUS_FC_READ_DISCRETE_INPUTS:
+        return modbus_read_input_bits(connection.ctx, transaction.address, transaction.length,
+            static_cast<uint8_t*>(transaction.data));
+      case MODBUS_FC_READ_HOLDING_REGISTERS:
+        return modbus_read_registers(
+            connection.ctx, transaction.address, transaction.length, static_cast<uint16_t*>(transaction.data));
+      case MODBUS_FC_READ_INPUT_REGISTERS:
+        return modbus_read_input_registers(
+            connection.ctx, transaction.address, transaction.length, static_cast<uint16_t*>(transaction.data));
+      case MODBUS_FC_WRITE_SINGLE_COIL:
+        return modbus_write_bit(connection.ctx, transaction.address, *static_cast<const uint8_t*>(transaction.data));
+      case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return modbus_write_register(
+            connection.ctx, transaction.address, *static_cast<const uint16_t*>(transaction.data));
+      case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        return modbus_write_bits(connection.ctx, transaction.address, transaction.length,
+            static_cast<const uint8_t*>(transaction.data));
+      case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return modbus_write_registers(connection.ctx, transaction.address, transaction.length,
+            static_cast<const uint16_t*>(transaction.data));
+      default:
+        throw ChimeraTK::logic_error(
+            "ModbusBackend: Unsupported function code " + std::to_string(transaction.function) + ".");
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::transferPipelined(Connection& connection, const std::vector<ModbusTransaction>& transactions,
+      uint64_t bar, uint64_t addressInBytes, bool isWrite) {
+    auto socket = modbus_get_socket(connection.ctx);
+    auto unitId = static_cast<uint8_t>(modbus_get_slave(connection.ctx));
+    std::array<uint8_t, ModbusTcpFrame::maxLength> frame{};
+
+    // transaction ids of the requests in flight together with the index into transactions
+    std::deque<std::pair<uint16_t, size_t>> inFlight;
+    size_t nextToSend = 0;
+    std::vector<bool> completed(transactions.size(), false);
+    std::vector<std::chrono::steady_clock::time_point> sentAt(transactions.size());
+
+    // The first failed transaction with its return code and errno. After a failure no further requests are sent, but
+    // the responses in flight are still collected, so the completed transactions are known exactly. If that is not
+    // possible (I/O error, timeout or unexpected response), the connection has lost track of the requests in flight.
+    struct Failure {
+      int rc;
+      int error;
+      size_t index;
+    };
+    std::optional<Failure> failure;
+    bool lostTrack = false;
+    auto recordFailure = [&](int rc, size_t index) {
+      _statistics.recordTransaction(transactions[index], false, std::chrono::steady_clock::now() - sentAt[index]);
+      if(!failure) {
+        failure = Failure{rc, errno, index};
+      }
+    };
+
+    while(!lostTrack && ((!failure && nextToSend < transactions.size()) || !inFlight.empty())) {
+      // send requests back to back until the window is full
+      while(!failure && nextToSend < transactions.size() && inFlight.size() < _pipelineWindow) {
+        auto transactionId = connection.nextTransactionId++;
+        sentAt[nextToSend] = std::chrono::steady_clock::now();
+        auto frameLength = ModbusTcpFrame::encodeRequest(transactions[nextToSend], transactionId, unitId, frame.data());
+        // a partially sent request counts as in flight, its state is unknown
+        inFlight.emplace_back(transactionId, nextToSend);
+        size_t sent = 0;
+        while(sent < frameLength) {
+          auto rc = ::send(socket, frame.data() + sent, frameLength - sent, MSG_NOSIGNAL);
+          if(rc == -1 && errno == EINTR) {
+            continue;
+          }
+          if(rc == -1) {
+            recordFailure(-1, nextToSend);
+            lostTrack = true;
+            break;
+          }
+          sent += size_t(rc);
+        }
+        ++nextToSend;
+      }
+      if(lostTrack) {
+        break;
+      }
+
+      // receive the next response and match it by its transaction id (the server may reorder responses)
+      auto frameLength = modbus_receive_confirmation(connection.ctx, frame.data());
+      if(frameLength == -1) {
+        recordFailure(-1, inFlight.front().second);
+        lostTrack = true;
+        break;
+      }
+      auto transactionId = ModbusTcpFrame::transactionId(frame.data());
+      auto match = std::find_if(inFlight.begin(), inFlight.end(),
+          [&](const std::pair<uint16_t, size_t>& entry) { return entry.first == transactionId; });
+      if(match == inFlight.end()) {
+        errno = EMBBADDATA;
+        recordFailure(-1, inFlight.front().second);
+        lostTrack = true;
+        break;
+      }
+      auto index = match->second;
+      inFlight.erase(match);
+      auto rc = ModbusTcpFrame::decodeResponse(transactions[index], unitId, frame.data(), size_t(frameLength));
+      if(rc != transactions[index].length) {
+        // e.g. an exception response: the framing is intact, so the remaining responses can still be collected
+        recordFailure(rc, index);
+        continue;
+      }
+      _statistics.recordTransaction(transactions[index], true, std::chrono::steady_clock::now() - sentAt[index]);
+      completed[index] = true;
+    }
+
+    if(failure) {
+      std::vector<bool> unknown(transactions.size(), false);
+      for(const auto& entry : inFlight) {
+        unknown[entry.second] = true;
+      }
+      if(lostTrack) {
+        // responses to the requests in flight may still arrive, so the connection cannot be used any further
+        connection.broken = true;
+      }
+      errno = failure->error;
+      checkErrorAndThrow(failure->rc, &connection, transactions[failure->index], bar, addressInBytes, isWrite,
+          describeCompleted(transactions, completed, bar), describeCompleted(transactions, unknown, bar));
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::transferAsync(
+      const std::vector<ModbusTransaction>& transactions, uint64_t bar, uint64_t addressInBytes, bool isWrite) {
+    // all requests are sent at once, the I/O thread collects the responses
+    auto* connection = _bus->asyncConnection();
+    auto submitted = std::chrono::steady_clock::now();
+    std::vector<std::future<int>> results;
+    results.reserve(transactions.size());
+    for(const auto& transaction : transactions) {
+      results.push_back(connection->submit(transaction, static_cast<uint8_t>(_slaveId)));
+    }
+
+    // wait for all results even after a failure, since the I/O thread may write into the buffers until then
+    std::vector<bool> completed(transactions.size(), false);
+    std::optional<std::pair<size_t, int>> failure;
+    for(size_t i = 0; i < transactions.size(); ++i) {
+      auto rc = results[i].get();
+      // the results are collected in order, so this is an upper bound of the latency
+      _statistics.recordTransaction(
+          transactions[i], rc == transactions[i].length, std::chrono::steady_clock::now() - submitted);
+      if(rc == transactions[i].length) {
+        completed[i] = true;
       }
+      else if(!failure) {
+        failure = {i, rc};
+      }
+    }
+    if(failure) {
+      auto [index, rc] = *failure;
+      if(rc < 0) {
+        errno = -rc;
+        rc = -1;
+      }
+      checkErrorAndThrow(rc, nullptr, transactions[index], bar, addressInBytes, isWrite,
+          describeCompleted(transactions, completed, bar));
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  std::string ModbusBackend::describeCompleted(
+      const std::vector<ModbusTransaction>& transactions, const std::vector<bool>& completed, uint64_t bar) {
+    // preserve errno, which is evaluated afterwards by checkErrorAndThrow()
+    auto error = errno;
+    std::string ranges;
+    for(size_t i = 0; i < transactions.size(); ++i) {
+      if(!completed[i]) {
+        continue;
+      }
+      // merge consecutive completed transactions into one range
+      auto first = transactions[i].address;
+      while(i + 1 < transactions.size() && completed[i + 1] &&
+          transactions[i + 1].address == transactions[i].address + transactions[i].length) {
+        ++i;
+      }
+      auto last = transactions[i].address + transactions[i].length - 1;
+      ranges += (ranges.empty() ? "" : ", ") + std::to_string(first) + "-" + std::to_string(last);
+    }
+    errno = error;
+    if(ranges.empty()) {
+      return {};
+    }
+    return (bar >= 3 ? "registers " : "bits ") + ranges;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::checkErrorAndThrow(int rc, Connection* connection, const ModbusTransaction& transaction,
+      uint64_t bar, uint64_t addressInBytes, bool isWrite, const std::string& completedTransactions,
+      const std::string& unknownTransactions) {
+    if(rc != transaction.length) {
+      auto modbusError = handleFailedTransaction(rc, connection, transaction, bar);
       using namespace std::literals::string_literals;
-      throw ChimeraTK::runtime_error("ModbusBackend failed "s + (isWrite ? "writing" : "reading") + " address (" +
-          std::to_string(bar) + "," + std::to_string(addressInBytes) + ") length " + std::to_string(length) + ": " +
-          modbusError);
+      auto message = "ModbusBackend failed "s + (isWrite ? "writing" : "reading") + " address (" +
+          std::to_string(bar) + "," + std::to_string(addressInBytes) + ") length " +
+          std::to_string(transaction.length) + ": " + modbusError;
+      if(isWrite) {
+        // for chunked writes, report which parts have been applied to the device
+        message += completedTransactions.empty() ? "; nothing has been written before the failure" :
+                                                   "; already written (Modbus addresses): " + completedTransactions;
+        if(!unknownTransactions.empty()) {
+          message += "; unknown whether written (Modbus addresses): " + unknownTransactions;
+        }
+      }
+      throw ChimeraTK::runtime_error(message);
     }
   }
 
   /********************************************************************************************************************/
 
+  std::string ModbusBackend::handleFailedTransaction(
+      int rc, Connection* connection, const ModbusTransaction& transaction, uint64_t bar) {
+    std::string modbusError;
+    int error;
+    if(rc == -1) {
+      error = errno;
+      modbusError = modbus_strerror(error);
+    }
+    else {
+      error = EMBMDATA;
+      modbusError = "Not all registers were transferred.";
+    }
+    if(connection != nullptr) {
+      _bus->handleError(*connection, error);
+    }
+    _statistics.recordException();
+    {
+      // remember the start of the failed transaction, it is read again in open() to check the recovery
+      std::lock_guard<std::mutex> lock(_lastFailedAddressMutex);
+      _lastFailedAddress = {bar, (bar >= 3) ? uint64_t(transaction.address) * 2 : uint64_t(transaction.address)};
+    }
+    return modbusError;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::startInterruptHandlingThread(uint32_t interruptNumber) {
+    std::lock_guard<std::mutex> lock(_pollMutex);
+    auto group = _pollGroups.find(interruptNumber);
+    if(group == _pollGroups.end()) {
+      throw ChimeraTK::logic_error("ModbusBackend: No poll period configured for interrupt " +
+          std::to_string(interruptNumber) + " (see parameter pollPeriods).");
+    }
+    if(!group->second.active) {
+      group->second.active = true;
+      group->second.nextDue = std::chrono::steady_clock::now();
+      group->second.lastContent.clear();
+    }
+    if(!_pollerThread.joinable()) {
+      _pollerShutdown = false;
+      _pollerThread = std::thread([this] { pollerThread(); });
+    }
+    _pollCondition.notify_all();
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::stopPoller() {
+    {
+      std::lock_guard<std::mutex> lock(_pollMutex);
+      _pollerShutdown = true;
+    }
+    _pollCondition.notify_all();
+    if(_pollerThread.joinable()) {
+      _pollerThread.join();
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::pollerThread() {
+    std::unique_lock<std::mutex> lock(_pollMutex);
+    while(!_pollerShutdown) {
+      auto now = std::chrono::steady_clock::now();
+      auto nextDue = std::chrono::steady_clock::time_point::max();
+      for(auto& [interrupt, group] : _pollGroups) {
+        if(group.active) {
+          nextDue = std::min(nextDue, group.nextDue);
+        }
+      }
+      if(nextDue > now) {
+        if(nextDue == std::chrono::steady_clock::time_point::max()) {
+          _pollCondition.wait(lock);
+        }
+        else {
+          _pollCondition.wait_until(lock, nextDue);
+        }
+        continue;
+      }
+
+      // Collect all due groups. Groups sharing a period fall due together and are read with merged requests.
+      std::vector<uint32_t> due;
+      std::map<uint64_t, std::vector<ModbusAddressRange>> ranges;
+      for(auto& [interrupt, group] : _pollGroups) {
+        if(!group.active || group.nextDue > now) {
+          continue;
+        }
+        due.push_back(interrupt);
+        for(auto& [bar, barRanges] : group.ranges) {
+          ranges[bar].insert(ranges[bar].end(), barRanges.begin(), barRanges.end());
+        }
+        group.nextDue += group.period;
+        if(group.nextDue <= now) {
+          // we are lagging behind (e.g. after an exception): do not try to catch up
+          group.nextDue = now + group.period;
+        }
+      }
+
+      lock.unlock();
+      poll(due, std::move(ranges));
+      lock.lock();
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::poll(
+      const std::vector<uint32_t>& groups, std::map<uint64_t, std::vector<ModbusAddressRange>> ranges) {
+    // in case of an exception, wait until the application has recovered the device
+    if(!isFunctional()) {
+      return;
+    }
+
+    std::vector<PollBlock> snapshot;
+    try {
+      for(auto& [bar, barRanges] : ranges) {
+        size_t elementSize = (bar >= 3) ? 2 : 1;
+        for(const auto& block : _planner.plan(bar, std::move(barRanges))) {
+          auto sizeInBytes = size_t(block.length()) * elementSize;
+          PollBlock pollBlock{bar, block, std::vector<int32_t>((sizeInBytes + 3) / 4)};
+          readRaw(bar, uint64_t(block.begin) * elementSize, pollBlock.data.data(), sizeInBytes);
+          snapshot.push_back(std::move(pollBlock));
+        }
+      }
+    }
+    catch(ChimeraTK::runtime_error& ex) {
+      setException(ex.what());
+      return;
+    }
+
+    // publish the groups, the dispatcher's reads are served from the snapshot in this thread. The snapshot is revoked
+    // also if dispatchInterrupt() throws.
+    struct SnapshotPublication {
+      SnapshotPublication(ModbusBackend& backend, const std::vector<PollBlock>& snapshot) : _backend(backend) {
+        _backend._currentSnapshot = &snapshot;
+        _backend._snapshotThread = std::this_thread::get_id();
+      }
+      ~SnapshotPublication() {
+        _backend._snapshotThread = std::thread::id();
+        _backend._currentSnapshot = nullptr;
+      }
+      SnapshotPublication(const SnapshotPublication&) = delete;
+      SnapshotPublication& operator=(const SnapshotPublication&) = delete;
+      ModbusBackend& _backend;
+    };
+    SnapshotPublication publication(*this, snapshot);
+    for(auto interrupt : groups) {
+      auto& group = _pollGroups.at(interrupt);
+      if(_pollOnlyChanged) {
+        std::vector<uint8_t> content;
+        for(const auto& [bar, barRanges] : group.ranges) {
+          size_t elementSize = (bar >= 3) ? 2 : 1;
+          for(const auto& range : barRanges) {
+            std::vector<uint8_t> part(size_t(range.length()) * elementSize);
+            readFromSnapshot(bar, uint64_t(range.begin) * elementSize,
+                static_cast<int32_t*>(static_cast<void*>(part.data())), part.size());
+            content.insert(content.end(), part.begin(), part.end());
+          }
+        }
+        if(content == group.lastContent) {
+          continue;
+        }
+        group.lastContent = std::move(content);
+      }
+      dispatchInterrupt(interrupt);
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusBackend::readFromSnapshot(uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes) {
+    size_t elementSize = (bar >= 3) ? 2 : 1;
+    auto begin = int(addressInBytes / elementSize);
+    auto end = int((addressInBytes + std::max(sizeInBytes, elementSize) + elementSize - 1) / elementSize);
+    for(const auto& block : *_currentSnapshot) {
+      if(block.bar != bar || block.range.begin > begin || block.range.end < end) {
+        continue;
+      }
+      const auto* source = static_cast<const uint8_t*>(static_cast<const void*>(block.data.data()));
+      std::memcpy(data, source + size_t(begin - block.range.begin) * elementSize, sizeInBytes);
+      return true;
+    }
+    return false;
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusBackend::readFromCache(uint64_t bar, uint64_t addressInBytes, int32_t* data, size_t sizeInBytes) {
+    size_t elementSize = (bar == 4) ? 2 : 1;
+    auto begin = int(addressInBytes / elementSize);
+    auto end = int((addressInBytes + std::max(sizeInBytes, elementSize) + elementSize - 1) / elementSize);
+
+    // find the blocks overlapping the request, they must cover it completely
+    std::vector<size_t> blocks;
+    auto covered = begin;
+    for(size_t i = 0; i < _cache.size(); ++i) {
+      const auto& block = _cache[i];
+      if(block.bar != bar || block.range.end <= begin || block.range.begin >= end) {
+        continue;
+      }
+      if(block.range.begin > covered) {
+        return false;
+      }
+      covered = block.range.end;
+      blocks.push_back(i);
+    }
+    if(covered < end) {
+      return false;
+    }
+
+    // data fetched by this thread, which is used even if it is older than the maximum age by now
+    std::map<size_t, std::vector<int32_t>> fetched;
+
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+    for(;;) {
+      auto now = std::chrono::steady_clock::now();
+      bool complete = true;
+      std::vector<size_t> claimed;
+      for(auto i : blocks) {
+        auto& block = _cache[i];
+        if(fetched.count(i) || (block.valid && now - block.timestamp <= _cacheMaxAge)) {
+          continue;
+        }
+        complete = false;
+        // only one thread fetches a block, the others wait for it
+        if(!block.fetching) {
+          block.fetching = true;
+          claimed.push_back(i);
+        }
+      }
+
+      if(complete) {
+        auto* target = static_cast<uint8_t*>(static_cast<void*>(data));
+        for(auto i : blocks) {
+          const auto& block = _cache[i];
+          const auto& blockData = fetched.count(i) ? fetched[i] : block.data;
+          const auto* source = static_cast<const uint8_t*>(static_cast<const void*>(blockData.data()));
+          auto first = std::max(begin, block.range.begin);
+          auto last = std::min(end, block.range.end);
+          auto nBytes = std::min(size_t(last - first) * elementSize, sizeInBytes - size_t(first - begin) * elementSize);
+          std::memcpy(target + size_t(first - begin) * elementSize,
+              source + size_t(first - block.range.begin) * elementSize, nBytes);
+        }
+        return true;
+      }
+
+      if(claimed.empty()) {
+        _cacheCondition.wait(lock);
+        continue;
+      }
+
+      // fetch the claimed blocks without holding the cache lock
+      auto generation = _cacheGeneration;
+      auto timestamp = now;
+      lock.unlock();
+      try {
+        for(size_t first = 0; first < claimed.size();) {
+          // consecutive blocks are fetched with a single (possibly pipelined) transfer
+          auto last = first;
+          while(last + 1 < claimed.size() && _cache[claimed[last + 1]].range.begin == _cache[claimed[last]].range.end) {
+            ++last;
+          }
+          ModbusAddressRange run{_cache[claimed[first]].range.begin, _cache[claimed[last]].range.end};
+          auto runSize = size_t(run.length()) * elementSize;
+          std::vector<int32_t> runData((runSize + 3) / 4);
+          readDevice(bar, uint64_t(run.begin) * elementSize, runData.data(), runSize);
+
+          const auto* source = static_cast<const uint8_t*>(static_cast<const void*>(runData.data()));
+          for(auto k = first; k <= last; ++k) {
+            const auto& range = _cache[claimed[k]].range;
+            auto blockSize = size_t(range.length()) * elementSize;
+            std::vector<int32_t> blockData((blockSize + 3) / 4);
+            std::memcpy(blockData.data(), source + size_t(range.begin - run.begin) * elementSize, blockSize);
+            fetched[claimed[k]] = std::move(blockData);
+          }
+          first = last + 1;
+        }
+      }
+      catch(...) {
+        lock.lock();
+        for(auto i : claimed) {
+          _cache[i].fetching = false;
+        }
+        _cacheCondition.notify_all();
+        throw;
+      }
+      lock.lock();
+      for(auto i : claimed) {
+        auto& block = _cache[i];
+        block.fetching = false;
+        if(generation == _cacheGeneration) {
+          block.data = fetched[i];
+          block.timestamp = timestamp;
+          block.valid = true;
+        }
+      }
+      _cacheCondition.notify_all();
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBackend::invalidateCache() noexcept {
+    std::lock_guard<std::mutex> lock(_cacheMutex);
+    for(auto& block : _cache) {
+      block.valid = false;
+    }
+    ++_cacheGeneration;
+  }
+
+  /********************************************************************************************************************/
+
+  std::optional<std::pair<uint64_t, uint64_t>> ModbusBackend::getLastFailedAddress() {
+    std::lock_guard<std::mutex> lock(_lastFailedAddressMutex);
+    return _lastFailedAddress;
+  }
+
+  /********************************************************************************************************************/
+
   bool ModbusBackend::barIndexValid(uint64_t bar) {
-    return (bar == 0) || (bar == 1) || (bar == 3) || (bar == 4);
+    return (bar == 0) || (bar == 1) || (bar == 3) || (bar == 4) || (bar == ModbusStatistics::bar);
   }
 
   /********************************************************************************************************************/
 
   void ModbusBackend::setExceptionImpl() noexcept {
+    invalidateCache();
+    {
+      // The application writes all values again when recovering the device, the buffered ones are outdated then.
+      std::lock_guard<std::mutex> lock(_writeBufferMutex);
+      _writeBuffer.clear();
+      _writeBufferSize = 0;
+    }
     closeConnection();
   }
 
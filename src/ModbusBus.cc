@@ -0,0 +1,551 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+#include "ModbusBus.h"
+
+#include <ChimeraTK/Exception.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <iterator>
+
+namespace ChimeraTK {
+
+  /********************************************************************************************************************/
+
+  namespace {
+    // backoff of the reconnect thread after a failed connect
+    constexpr std::chrono::milliseconds minReconnectBackoff{10};
+    constexpr std::chrono::milliseconds maxReconnectBackoff{2000};
+
+    // read a timeout in milliseconds from the parameters
+    std::optional<std::chrono::milliseconds> parseTimeout(
+        const std::map<std::string, std::string>& parameters, const std::string& name) {
+      auto timeout_str = parameters.find(name);
+      if(timeout_str == parameters.end()) {
+        return std::nullopt;
+      }
+      auto timeout = std::stoi(timeout_str->second);
+      if(timeout <= 0) {
+        throw ChimeraTK::logic_error("ModbusBackend: " + name + " must be a positive number of milliseconds.");
+      }
+      return std::chrono::milliseconds(timeout);
+    }
+
+    bool parseFlag(const std::map<std::string, std::string>& parameters, const std::string& name) {
+      auto flag_str = parameters.find(name);
+      return flag_str != parameters.end() && std::stoi(flag_str->second) != 0;
+    }
+
+    void setTimeout(int (*setter)(modbus_t*, uint32_t, uint32_t), modbus_t* ctx, std::chrono::milliseconds timeout) {
+      setter(ctx, uint32_t(timeout.count() / 1000), uint32_t(timeout.count() % 1000) * 1000);
+    }
+  } // namespace
+
+  /********************************************************************************************************************/
+
+  void ModbusLaneMutex::lock(ModbusLane lane) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto index = size_t(lane);
+    auto ticket = _nextTicket[index]++;
+    if(lane == ModbusLane::bulk) {
+      _bulkArrivals.push_back(Clock::now());
+    }
+
+    while(true) {
+      auto now = Clock::now();
+      bool isNext = !_locked && _nowServing[index] == ticket;
+      if(isNext && lane == ModbusLane::urgent && !bulkOverdue(now)) {
+        break;
+      }
+      if(isNext && lane == ModbusLane::bulk && !_bulkYielded && (!urgentWaiting() || bulkOverdue(now))) {
+        break;
+      }
+      if(isNext && lane == ModbusLane::bulk && !_bulkYielded && !_urgentTurn) {
+        // only held back by urgent waiters. Becoming overdue is not notified.
+        _condition.wait_until(lock, _bulkArrivals.front() + _bulkMaxWait);
+      }
+      else {
+        _condition.wait(lock);
+      }
+    }
+
+    _locked = true;
+    ++_nowServing[index];
+    if(lane == ModbusLane::bulk) {
+      _bulkArrivals.pop_front();
+      // an overdue bulk transfer has passed the urgent waiters, now it is their turn again
+      _urgentTurn = urgentWaiting();
+    }
+    else {
+      _urgentTurn = false;
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusLaneMutex::try_lock() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(_locked || _bulkYielded || urgentWaiting() || !_bulkArrivals.empty()) {
+      // locked or others are queued already
+      return false;
+    }
+    _locked = true;
+    return true;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusLaneMutex::unlock() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _locked = false;
+    }
+    _condition.notify_all();
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusLaneMutex::yieldToUrgent() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if(!urgentWaiting()) {
+      return false;
+    }
+    _locked = false;
+    _bulkYielded = true;
+    _yieldedSince = Clock::now();
+    _condition.notify_all();
+
+    // other bulk waiters are held back by _bulkYielded, so the lock is re-acquired as soon as the urgent lane is empty
+    // or the latency bound is reached
+    while(_locked || (urgentWaiting() && !bulkOverdue(Clock::now()))) {
+      if(_locked || _urgentTurn) {
+        _condition.wait(lock);
+      }
+      else {
+        _condition.wait_until(lock, _yieldedSince + _bulkMaxWait);
+      }
+    }
+    _locked = true;
+    _bulkYielded = false;
+    _urgentTurn = urgentWaiting();
+    return true;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusLaneMutex::setBulkMaxWait(std::chrono::milliseconds maxWait) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _bulkMaxWait = maxWait;
+  }
+
+  /********************************************************************************************************************/
+
+  size_t ModbusLaneMutex::nWaiting(ModbusLane lane) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(lane == ModbusLane::bulk) {
+      return _bulkArrivals.size();
+    }
+    auto urgent = size_t(ModbusLane::urgent);
+    return size_t(_nextTicket[urgent] - _nowServing[urgent]);
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusLaneMutex::bulkOverdue(Clock::time_point now) const {
+    if(_urgentTurn) {
+      return false;
+    }
+    if(_bulkYielded) {
+      return now - _yieldedSince >= _bulkMaxWait;
+    }
+    return !_bulkArrivals.empty() && now - _bulkArrivals.front() >= _bulkMaxWait;
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusLaneMutex::urgentWaiting() const {
+    auto urgent = size_t(ModbusLane::urgent);
+    return _nextTicket[urgent] != _nowServing[urgent];
+  }
+
+  /********************************************************************************************************************/
+
+  std::shared_ptr<ModbusBus> ModbusBus::get(ModbusType type, const std::string& address,
+      const std::map<std::string, std::string>& parameters, size_t nConnections) {
+    static std::mutex registryMutex;
+    static std::map<std::string, std::weak_ptr<ModbusBus>> registry;
+
+    // A serial port can only be opened once, so all slaves on it must share the bus. In TCP mode, backends share the
+    // connections only if they would open the same number of connections to the same server anyway.
+    std::string key;
+    if(type == tcp) {
+      key = "tcp:" + address + ":" + parameters.at("port") + "/" + std::to_string(nConnections);
+      if(parameters.count("transport")) {
+        key += "/" + parameters.at("transport");
+      }
+    }
+    else {
+      key = "rtu:" + address;
+    }
+
+    // validate the timeouts also if the bus exists already
+    const std::array<const char*, 4> timeouts{"connectTimeout", "responseTimeout", "byteTimeout", "bulkMaxWait"};
+    for(const auto* name : timeouts) {
+      parseTimeout(parameters, name);
+    }
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    // forget buses which are no longer used, so the registry does not grow with every endpoint ever used
+    for(auto entry = registry.begin(); entry != registry.end();) {
+      entry = entry->second.expired() ? registry.erase(entry) : std::next(entry);
+    }
+    auto bus = registry[key].lock();
+    if(bus) {
+      // the settings of the bus are shared by all its users, so they must agree
+      auto mismatch = [&](const std::string& name) {
+        return ChimeraTK::logic_error("ModbusBackend: " + std::string(type == tcp ? "Connection to " : "Serial port ") +
+            address + " is already in use with different settings (parameter " + name + ").");
+      };
+      if(type == rtu) {
+        for(const auto* name : {"baud", "parity", "databits", "stopbits"}) {
+          if(bus->_parameters.at(name) != parameters.at(name)) {
+            throw mismatch(name);
+          }
+        }
+      }
+      for(const auto* name : timeouts) {
+        if(parseTimeout(bus->_parameters, name) != parseTimeout(parameters, name)) {
+          throw mismatch(name);
+        }
+      }
+      if(parseFlag(bus->_parameters, "reconnect") != parseFlag(parameters, "reconnect")) {
+        throw mismatch("reconnect");
+      }
+      return bus;
+    }
+    bus = std::make_shared<ModbusBus>(type, address, parameters, nConnections);
+    registry[key] = bus;
+    return bus;
+  }
+
+  /********************************************************************************************************************/
+
+  ModbusBus::ModbusBus(
+      ModbusType type, std::string address, std::map<std::string, std::string> parameters, size_t nConnections)
+  : _type(type), _address(std::move(address)), _parameters(std::move(parameters)) {
+    _connectTimeout = parseTimeout(_parameters, "connectTimeout");
+    _responseTimeout = parseTimeout(_parameters, "responseTimeout");
+    _byteTimeout = parseTimeout(_parameters, "byteTimeout");
+
+    _reconnect = parseFlag(_parameters, "reconnect");
+
+    auto transport = _parameters.find("transport");
+    if(_type == tcp && transport != _parameters.end() && transport->second == "async") {
+      _asyncConnection = std::make_shared<ModbusAsyncConnection>(_address, _parameters.at("port"));
+      if(_connectTimeout) {
+        _asyncConnection->setConnectTimeout(*_connectTimeout);
+      }
+      if(_responseTimeout) {
+        _asyncConnection->setResponseTimeout(*_responseTimeout);
+      }
+      return;
+    }
+    auto bulkMaxWait = parseTimeout(_parameters, "bulkMaxWait");
+    for(size_t i = 0; i < nConnections; ++i) {
+      _connections.push_back(std::make_unique<Connection>());
+      if(bulkMaxWait) {
+        _connections.back()->mutex.setBulkMaxWait(*bulkMaxWait);
+      }
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  ModbusBus::~ModbusBus() {
+    {
+      std::lock_guard<std::mutex> lock(_openUsersMutex);
+      stopReconnect();
+    }
+    closeConnections(false);
+  }
+
+  /********************************************************************************************************************/
+
+  size_t ModbusBus::open(const void* user) {
+    size_t nConnects = 0;
+    if(_asyncConnection && !_asyncConnection->isConnected()) {
+      // an asynchronous connection closes itself on connection errors
+      _asyncConnection->connect();
+      ++nConnects;
+    }
+    for(auto& connection : _connections) {
+      Lock lock(connection->mutex);
+      if(connection->ctx != nullptr && connection->broken) {
+        modbus_close(connection->ctx);
+        modbus_free(connection->ctx);
+        connection->ctx = nullptr;
+      }
+      if(connection->ctx != nullptr) {
+        continue;
+      }
+      connection->broken = false;
+      // a connection established in the background is used right away
+      connection->ctx = takeReserve();
+      if(connection->ctx == nullptr) {
+        connection->ctx = connectContext();
+        reestablished();
+      }
+      ++nConnects;
+    }
+
+    std::lock_guard<std::mutex> lock(_openUsersMutex);
+    _openUsers.insert(user);
+    if(_reconnect && !_asyncConnection && !_reconnectThread.joinable()) {
+      {
+        std::lock_guard<std::mutex> reconnectLock(_reconnectMutex);
+        _reconnectShutdown = false;
+      }
+      _reconnectThread = std::thread([this] { reconnectThread(); });
+    }
+    return nConnects;
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusBus::isOpenByOthers(const void* user) {
+    std::lock_guard<std::mutex> lock(_openUsersMutex);
+    return _openUsers.size() > _openUsers.count(user);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBus::close(const void* user) {
+    {
+      std::lock_guard<std::mutex> lock(_openUsersMutex);
+      _openUsers.erase(user);
+      if(!_openUsers.empty()) {
+        return;
+      }
+      stopReconnect();
+    }
+    closeConnections(false);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBus::closeConnections(bool onlyBroken) {
+    if(_asyncConnection && !onlyBroken) {
+      _asyncConnection->close();
+    }
+    size_t nClosed = 0;
+    for(auto& connection : _connections) {
+      Lock lock(connection->mutex);
+      if(connection->ctx != nullptr && (!onlyBroken || connection->broken)) {
+        modbus_close(connection->ctx);
+        modbus_free(connection->ctx);
+        connection->ctx = nullptr;
+        ++nClosed;
+      }
+    }
+
+    // the reconnect thread only runs while the bus is in use
+    std::lock_guard<std::mutex> lock(_reconnectMutex);
+    if(nClosed > 0 && !_reconnectShutdown) {
+      _nLost += nClosed;
+      _reconnectCondition.notify_all();
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  modbus_t* ModbusBus::createContext() {
+    modbus_t* ctx;
+    if(_type == tcp) {
+      ctx = modbus_new_tcp_pi(_address.c_str(), _parameters.at("port").c_str());
+    }
+    else {
+      ctx = modbus_new_rtu(_address.c_str(), std::stoi(_parameters.at("baud")), *_parameters.at("parity").c_str(),
+          std::stoi(_parameters.at("databits")), std::stoi(_parameters.at("stopbits")));
+    }
+    if(ctx == nullptr) {
+      throw ChimeraTK::logic_error(
+          std::string("ModbusBackend: Unable to create libmodbus context: ") + modbus_strerror(errno));
+    }
+    return ctx;
+  }
+
+  /********************************************************************************************************************/
+
+  modbus_t* ModbusBus::connectContext() {
+    auto* ctx = createContext();
+    if(_byteTimeout) {
+      setTimeout(modbus_set_byte_timeout, ctx, *_byteTimeout);
+    }
+    // libmodbus uses the response timeout also for establishing the TCP connection
+    uint32_t responseTimeoutSec = 0;
+    uint32_t responseTimeoutUsec = 0;
+    modbus_get_response_timeout(ctx, &responseTimeoutSec, &responseTimeoutUsec);
+    if(_connectTimeout) {
+      setTimeout(modbus_set_response_timeout, ctx, *_connectTimeout);
+    }
+
+    if(modbus_connect(ctx) == -1) {
+      // If server cannot be reached, errors ECONNREFUSED and EINPROGRESS might alternate. This will create
+      // many log messages e.g. in ApplicationCore and hence is here "filtered". EINPROGRESS is anyway a bit
+      // misleading in this context and hence is replaced with ECONNREFUSED.
+      auto error = errno;
+      if(error == EINPROGRESS) {
+        error = ECONNREFUSED;
+      }
+      modbus_free(ctx);
+      throw ChimeraTK::runtime_error(std::string("ModbusBackend: Connection failed: ") + modbus_strerror(error));
+    }
+
+    if(_responseTimeout) {
+      setTimeout(modbus_set_response_timeout, ctx, *_responseTimeout);
+    }
+    else {
+      modbus_set_response_timeout(ctx, responseTimeoutSec, responseTimeoutUsec);
+    }
+    return ctx;
+  }
+
+  /********************************************************************************************************************/
+
+  modbus_t* ModbusBus::takeReserve() {
+    std::lock_guard<std::mutex> lock(_reconnectMutex);
+    if(_reserve.empty()) {
+      return nullptr;
+    }
+    auto* ctx = _reserve.back();
+    _reserve.pop_back();
+    if(_nLost > 0) {
+      --_nLost;
+    }
+    return ctx;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBus::reestablished() {
+    std::lock_guard<std::mutex> lock(_reconnectMutex);
+    if(_nLost > 0) {
+      --_nLost;
+    }
+    // do not keep more idle connections than needed, servers often limit the number of connections
+    while(_reserve.size() > _nLost) {
+      modbus_close(_reserve.back());
+      modbus_free(_reserve.back());
+      _reserve.pop_back();
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBus::reconnectThread() {
+    auto backoff = minReconnectBackoff;
+    std::unique_lock<std::mutex> lock(_reconnectMutex);
+    while(true) {
+      _reconnectCondition.wait(lock, [&] { return _reconnectShutdown || _reserve.size() < _nLost; });
+      if(_reconnectShutdown) {
+        return;
+      }
+
+      lock.unlock();
+      modbus_t* ctx = nullptr;
+      try {
+        ctx = connectContext();
+      }
+      catch(ChimeraTK::runtime_error&) {
+        // retried after the backoff
+      }
+      lock.lock();
+
+      if(ctx != nullptr) {
+        // stopReconnect() discards the reserve after this thread has terminated
+        _reserve.push_back(ctx);
+        backoff = minReconnectBackoff;
+        continue;
+      }
+      _reconnectCondition.wait_for(lock, backoff, [&] { return _reconnectShutdown; });
+      backoff = std::min(backoff * 2, maxReconnectBackoff);
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBus::stopReconnect() {
+    if(!_reconnectThread.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_reconnectMutex);
+      _reconnectShutdown = true;
+    }
+    _reconnectCondition.notify_all();
+    _reconnectThread.join();
+
+    std::lock_guard<std::mutex> lock(_reconnectMutex);
+    for(auto* ctx : _reserve) {
+      modbus_close(ctx);
+      modbus_free(ctx);
+    }
+    _reserve.clear();
+    _nLost = 0;
+  }
+
+  /********************************************************************************************************************/
+
+  ModbusBus::Connection& ModbusBus::acquire(int slaveId, Lock& lock, ModbusLane lane) {
+    // Prefer an idle connection. The search starts at a rotating index to spread the load evenly.
+    auto first = _nextConnection++ % _connections.size();
+    for(size_t i = 0; i < _connections.size(); ++i) {
+      auto index = (first + i) % _connections.size();
+      lock = Lock(_connections[index]->mutex, std::try_to_lock);
+      if(lock.owns_lock()) {
+        return acquire(index, slaveId, lock, lane);
+      }
+    }
+
+    // all connections are busy: queue up on the first one
+    lock = Lock();
+    return acquire(first, slaveId, lock, lane);
+  }
+
+  /********************************************************************************************************************/
+
+  ModbusBus::Connection& ModbusBus::acquire(size_t index, int slaveId, Lock& lock, ModbusLane lane) {
+    auto& connection = *_connections.at(index);
+    if(!lock.owns_lock()) {
+      connection.mutex.lock(lane);
+      lock = Lock(connection.mutex, std::adopt_lock);
+    }
+    if(connection.ctx != nullptr) {
+      // the slave id has been validated by the backend already
+      modbus_set_slave(connection.ctx, slaveId);
+    }
+    return connection;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusBus::handleError(Connection& connection, int error) {
+    // Exception responses are sent by the slave, so the connection is in sync. In RTU mode, timeouts and corrupted
+    // frames are typically caused by a single slave (switched off, wrong baud rate), while the line itself is fine.
+    bool isExceptionResponse = error >= EMBXILFUN && error <= EMBXGTAR;
+    bool isSlaveError = _type == rtu && (error == ETIMEDOUT || error >= MODBUS_ENOBASE);
+    if(!isExceptionResponse && !isSlaveError) {
+      connection.broken = true;
+      return;
+    }
+    if(_type == rtu && connection.ctx != nullptr) {
+      // discard late or partial responses, they would otherwise be taken as response to the next request
+      modbus_flush(connection.ctx);
+    }
+  }
+
+  /********************************************************************************************************************/
+
+} // namespace ChimeraTK
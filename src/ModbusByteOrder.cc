@@ -0,0 +1,96 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+#include "ModbusByteOrder.h"
+
+#include <ChimeraTK/Exception.h>
+
+#include <cstdint>
+#include <cstring>
+
+namespace ChimeraTK {
+
+  /********************************************************************************************************************/
+
+  namespace {
+    // Apply the function to each value of type T in the buffer. Loads and stores go through memcpy, so the buffer
+    // needs no alignment. Compilers turn this into plain (vectorised) loads, shifts and masks.
+    template<typename T, typename FUNCTION>
+    void transform(uint8_t* buffer, size_t nValues, FUNCTION function) {
+      for(size_t i = 0; i < nValues; ++i) {
+        T value;
+        std::memcpy(&value, buffer + i * sizeof(T), sizeof(T));
+        value = function(value);
+        std::memcpy(buffer + i * sizeof(T), &value, sizeof(T));
+      }
+    }
+  } // namespace
+
+  /********************************************************************************************************************/
+
+  ModbusByteOrder ModbusByteOrder::parse(const std::string& name) {
+    const std::string letters = "ABCDEFGH";
+    for(size_t words : {1, 2, 4}) {
+      if(name.size() != 2 * words) {
+        continue;
+      }
+      for(bool swapWords : {false, true}) {
+        for(bool swapBytes : {false, true}) {
+          // the registers in transfer order: least significant first, unless swapped
+          std::string candidate;
+          for(size_t i = 0; i < words; ++i) {
+            auto word = swapWords ? i : words - 1 - i;
+            auto high = letters[2 * word];
+            auto low = letters[2 * word + 1];
+            candidate += swapBytes ? std::string{low, high} : std::string{high, low};
+          }
+          if(candidate == name) {
+            return ModbusByteOrder(words, swapWords, swapBytes);
+          }
+        }
+      }
+    }
+    throw ChimeraTK::logic_error("ModbusBackend: Unknown byte order '" + name + "'.");
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusByteOrder::apply(void* buffer, size_t nValues) const {
+    auto* bytes = static_cast<uint8_t*>(buffer);
+    // Both swaps are symmetric in the two halves resp. neighbouring bytes they exchange, so they do not depend on the
+    // endianness of the host.
+    switch(_wordsPerValue) {
+      case 1:
+        if(_swapBytes) {
+          transform<uint16_t>(bytes, nValues, [](uint16_t v) { return uint16_t((v << 8) | (v >> 8)); });
+        }
+        break;
+      case 2:
+        if(_swapWords) {
+          transform<uint32_t>(bytes, nValues, [](uint32_t v) { return (v << 16) | (v >> 16); });
+        }
+        if(_swapBytes) {
+          transform<uint32_t>(
+              bytes, nValues, [](uint32_t v) { return ((v & 0x00FF00FFU) << 8) | ((v >> 8) & 0x00FF00FFU); });
+        }
+        break;
+      case 4:
+        if(_swapWords) {
+          transform<uint64_t>(bytes, nValues, [](uint64_t v) {
+            v = (v << 32) | (v >> 32);
+            return ((v & 0x0000FFFF0000FFFFULL) << 16) | ((v >> 16) & 0x0000FFFF0000FFFFULL);
+          });
+        }
+        if(_swapBytes) {
+          transform<uint64_t>(bytes, nValues,
+              [](uint64_t v) { return ((v & 0x00FF00FF00FF00FFULL) << 8) | ((v >> 8) & 0x00FF00FF00FF00FFULL); });
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  /********************************************************************************************************************/
+
+} // namespace ChimeraTK
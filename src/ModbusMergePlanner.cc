@@ -0,0 +1,154 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+#include "ModbusMergePlanner.h"
+
+#include "modbus/modbus.h"
+
+#include <ChimeraTK/Exception.h>
+
+#include <algorithm>
+#include <sstream>
+
+namespace ChimeraTK {
+
+  /********************************************************************************************************************/
+
+  namespace {
+    bool isRegisterBar(uint64_t bar) {
+      return bar == 3 || bar == 4;
+    }
+
+    // maximum number of elements per read frame
+    int maxFrameLength(uint64_t bar) {
+      return isRegisterBar(bar) ? MODBUS_MAX_READ_REGISTERS : MODBUS_MAX_READ_BITS;
+    }
+
+    int nFrames(uint64_t bar, int length) {
+      return (length + maxFrameLength(bar) - 1) / maxFrameLength(bar);
+    }
+  } // namespace
+
+  /********************************************************************************************************************/
+
+  ModbusMergePlanner::ModbusMergePlanner(bool isTcp, const std::map<std::string, std::string>& parameters) {
+    auto maxGapWords = parameters.find("maxGapWords");
+    if(maxGapWords != parameters.end()) {
+      _maxGapWords = std::stoi(maxGapWords->second);
+      if(_maxGapWords < 0) {
+        throw ChimeraTK::logic_error("ModbusBackend: maxGapWords must not be negative.");
+      }
+    }
+    else if(isTcp) {
+      // The per-frame cost is dominated by the round trip, while a few hundred extra bytes are almost free. Merge
+      // whenever this saves a frame (checked in isWorthMerging()).
+      _maxGapWords = MODBUS_MAX_READ_REGISTERS;
+    }
+    else {
+      // RTU: request (8 bytes) + response header and CRC (5 bytes) + 2 * 3.5 characters of silence, plus about 1 ms
+      // turnaround time in the device. One register costs 2 bytes.
+      auto baud = parameters.count("baud") ? std::stoi(parameters.at("baud")) : 115200;
+      auto overheadBytes = 20 + baud / 10000;
+      _maxGapWords = overheadBytes / 2;
+    }
+
+    auto forbidden = parameters.find("forbiddenRanges");
+    if(forbidden != parameters.end()) {
+      std::stringstream list(forbidden->second);
+      std::string entry;
+      while(std::getline(list, entry, ',')) {
+        uint64_t bar;
+        uint64_t first;
+        uint64_t last;
+        char colon;
+        char dash;
+        std::stringstream entryStream(entry);
+        if(!(entryStream >> bar >> colon >> first >> dash >> last) || colon != ':' || dash != '-' || last < first) {
+          throw ChimeraTK::logic_error("ModbusBackend: Cannot parse forbiddenRanges entry '" + entry + "'.");
+        }
+        // convert inclusive map file addresses into Modbus addresses
+        ModbusAddressRange range{int(first), int(last) + 1};
+        if(isRegisterBar(bar)) {
+          range = {int(first / 2), int(last / 2) + 1};
+        }
+        _forbidden[bar].push_back(range);
+      }
+      for(auto& [bar, ranges] : _forbidden) {
+        std::sort(ranges.begin(), ranges.end(), [](auto& a, auto& b) { return a.begin < b.begin; });
+      }
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusMergePlanner::addMappedRange(uint64_t bar, ModbusAddressRange range) {
+    _mapped[bar].push_back(range);
+  }
+
+  /********************************************************************************************************************/
+
+  int ModbusMergePlanner::maxGap(uint64_t bar) const {
+    // a gap of bits costs the same on the wire as 1/16th of the registers
+    return isRegisterBar(bar) ? _maxGapWords : 16 * _maxGapWords;
+  }
+
+  /********************************************************************************************************************/
+
+  std::vector<ModbusAddressRange> ModbusMergePlanner::plan(uint64_t bar, std::vector<ModbusAddressRange> ranges) const {
+    std::sort(ranges.begin(), ranges.end(), [](auto& a, auto& b) { return a.begin < b.begin; });
+    std::vector<ModbusAddressRange> requests;
+    for(const auto& range : ranges) {
+      if(!requests.empty() && isWorthMerging(bar, requests.back(), range)) {
+        requests.back().end = std::max(requests.back().end, range.end);
+      }
+      else {
+        requests.push_back(range);
+      }
+    }
+    return requests;
+  }
+
+  /********************************************************************************************************************/
+
+  std::vector<ModbusAddressRange> ModbusMergePlanner::blocks(uint64_t bar) const {
+    auto mapped = _mapped.find(bar);
+    if(mapped == _mapped.end()) {
+      return {};
+    }
+    return plan(bar, mapped->second);
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusMergePlanner::isWorthMerging(
+      uint64_t bar, const ModbusAddressRange& a, const ModbusAddressRange& b) const {
+    auto gap = b.begin - a.end;
+    if(gap <= 0) {
+      // adjacent or overlapping
+      return true;
+    }
+    if(gap > maxGap(bar)) {
+      return false;
+    }
+    if(containsForbidden(bar, {a.end, b.begin})) {
+      return false;
+    }
+    // merging must save at least one frame, otherwise only the gap is read in addition
+    ModbusAddressRange merged{a.begin, std::max(a.end, b.end)};
+    return nFrames(bar, merged.length()) < nFrames(bar, a.length()) + nFrames(bar, b.length());
+  }
+
+  /********************************************************************************************************************/
+
+  bool ModbusMergePlanner::containsForbidden(uint64_t bar, ModbusAddressRange range) const {
+    auto forbidden = _forbidden.find(bar);
+    if(forbidden == _forbidden.end()) {
+      return false;
+    }
+    return std::any_of(forbidden->second.begin(), forbidden->second.end(),
+        [&](const ModbusAddressRange& f) { return f.begin < range.end && f.end > range.begin; });
+  }
+
+  /********************************************************************************************************************/
+
+} // namespace ChimeraTK
@@ -0,0 +1,175 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+#include "ModbusStatistics.h"
+
+#include "modbus/modbus.h"
+
+#include <ChimeraTK/Exception.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+namespace ChimeraTK {
+
+  /********************************************************************************************************************/
+
+  namespace {
+    uint32_t toMicroseconds(std::chrono::nanoseconds duration) {
+      auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+      return uint32_t(std::clamp<int64_t>(us, 0, std::numeric_limits<uint32_t>::max()));
+    }
+  } // namespace
+
+  /********************************************************************************************************************/
+
+  std::vector<ModbusStatistics::RegisterDescription> ModbusStatistics::describeRegisters() {
+    std::vector<RegisterDescription> registers{
+        {"connection/lockAcquisitions", lockAcquisitions * 4, 1},
+        {"connection/lockWaitSum_us", lockWaitSum * 4, 1},
+        {"connection/lockWaitMax_us", lockWaitMax * 4, 1},
+        {"connection/lockHoldSum_us", lockHoldSum * 4, 1},
+        {"connection/connects", connects * 4, 1},
+        {"connection/exceptions", exceptions * 4, 1},
+        {"connection/lockWaitHistogram", lockWaitHistogram * 4, nBuckets},
+    };
+
+    const std::vector<std::pair<int, std::string>> functions{{MODBUS_FC_READ_COILS, "readCoils"},
+        {MODBUS_FC_READ_DISCRETE_INPUTS, "readDiscreteInputs"},
+        {MODBUS_FC_READ_HOLDING_REGISTERS, "readHoldingRegisters"},
+        {MODBUS_FC_READ_INPUT_REGISTERS, "readInputRegisters"}, {MODBUS_FC_WRITE_SINGLE_COIL, "writeSingleCoil"},
+        {MODBUS_FC_WRITE_SINGLE_REGISTER, "writeSingleRegister"},
+        {MODBUS_FC_WRITE_MULTIPLE_COILS, "writeMultipleCoils"},
+        {MODBUS_FC_WRITE_MULTIPLE_REGISTERS, "writeMultipleRegisters"},
+        {MODBUS_FC_WRITE_AND_READ_REGISTERS, "writeAndReadRegisters"}};
+    for(const auto& [function, name] : functions) {
+      uint64_t block = uint64_t(function) * blockWords * 4;
+      registers.push_back({name + "/frames", block + frames * 4, 1});
+      registers.push_back({name + "/errors", block + errors * 4, 1});
+      registers.push_back({name + "/bytesSent", block + bytesSent * 4, 1});
+      registers.push_back({name + "/bytesReceived", block + bytesReceived * 4, 1});
+      registers.push_back({name + "/latencySum_us", block + latencySum * 4, 1});
+      registers.push_back({name + "/latencyMax_us", block + latencyMax * 4, 1});
+      registers.push_back({name + "/latencyHistogram", block + latencyHistogram * 4, nBuckets});
+    }
+    return registers;
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusStatistics::recordTransaction(
+      const ModbusTransaction& transaction, bool success, std::chrono::nanoseconds latency) {
+    auto n = size_t(transaction.length);
+    size_t requestPduBytes = 5;
+    size_t responsePduBytes = 5;
+    switch(transaction.function) {
+      case MODBUS_FC_READ_COILS:
+      case MODBUS_FC_READ_DISCRETE_INPUTS:
+        responsePduBytes = 2 + (n + 7) / 8;
+        break;
+      case MODBUS_FC_READ_HOLDING_REGISTERS:
+      case MODBUS_FC_READ_INPUT_REGISTERS:
+        responsePduBytes = 2 + 2 * n;
+        break;
+      case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        requestPduBytes = 6 + (n + 7) / 8;
+        break;
+      case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        requestPduBytes = 6 + 2 * n;
+        break;
+      default:
+        // single coil/register: address and value in both directions
+        break;
+    }
+    recordTransaction(transaction.function, requestPduBytes, responsePduBytes, success, latency);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusStatistics::recordTransaction(
+      int function, size_t requestPduBytes, size_t responsePduBytes, bool success, std::chrono::nanoseconds latency) {
+    if(function < 1 || size_t(function) >= nBlocks) {
+      return;
+    }
+    // MBAP header resp. slave address and CRC
+    size_t framing = _isTcp ? 7 : 3;
+    auto block = size_t(function) * blockWords;
+    auto us = toMicroseconds(latency);
+    add(block + frames, 1);
+    add(block + bytesSent, uint32_t(requestPduBytes + framing));
+    if(success) {
+      add(block + bytesReceived, uint32_t(responsePduBytes + framing));
+    }
+    else {
+      add(block + errors, 1);
+    }
+    add(block + latencySum, us);
+    updateMax(block + latencyMax, us);
+    addToHistogram(block + latencyHistogram, us);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusStatistics::recordLockWait(std::chrono::nanoseconds duration) {
+    auto us = toMicroseconds(duration);
+    add(lockAcquisitions, 1);
+    add(lockWaitSum, us);
+    updateMax(lockWaitMax, us);
+    addToHistogram(lockWaitHistogram, us);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusStatistics::recordLockHold(std::chrono::nanoseconds duration) {
+    add(lockHoldSum, toMicroseconds(duration));
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusStatistics::recordConnects(size_t nConnects) {
+    add(connects, uint32_t(nConnects));
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusStatistics::recordException() {
+    add(exceptions, 1);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusStatistics::updateMax(size_t index, uint32_t value) {
+    auto current = _words[index].load(std::memory_order_relaxed);
+    while(value > current && !_words[index].compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusStatistics::addToHistogram(size_t index, uint32_t microseconds) {
+    size_t bucket = 0;
+    while(bucket + 1 < nBuckets && (microseconds >> (bucket + 1)) != 0) {
+      ++bucket;
+    }
+    add(index + bucket, 1);
+  }
+
+  /********************************************************************************************************************/
+
+  void ModbusStatistics::read(uint64_t addressInBytes, int32_t* data, size_t sizeInBytes) const {
+    if(addressInBytes % 4 != 0 || addressInBytes + sizeInBytes > _words.size() * 4) {
+      throw ChimeraTK::logic_error("ModbusBackend: Invalid address range in statistics bar.");
+    }
+    auto first = size_t(addressInBytes / 4);
+    std::vector<uint32_t> words((sizeInBytes + 3) / 4);
+    for(size_t i = 0; i < words.size(); ++i) {
+      words[i] = _words[first + i].load(std::memory_order_relaxed);
+    }
+    std::memcpy(data, words.data(), sizeInBytes);
+  }
+
+  /********************************************************************************************************************/
+
+} // namespace ChimeraTK
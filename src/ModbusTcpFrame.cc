@@ -0,0 +1,168 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+
+#include "ModbusTcpFrame.h"
+
+#include "modbus/modbus.h"
+
+#include <cerrno>
+
+namespace ChimeraTK::ModbusTcpFrame {
+
+  /********************************************************************************************************************/
+
+  namespace {
+    void put16(uint8_t* buffer, int value) {
+      buffer[0] = static_cast<uint8_t>((value >> 8) & 0xFF);
+      buffer[1] = static_cast<uint8_t>(value & 0xFF);
+    }
+
+    uint16_t get16(const uint8_t* buffer) {
+      return static_cast<uint16_t>((buffer[0] << 8) | buffer[1]);
+    }
+
+    int fail(int error) {
+      errno = error;
+      return -1;
+    }
+  } // namespace
+
+  /********************************************************************************************************************/
+
+  size_t encodeRequest(const ModbusTransaction& transaction, uint16_t transactionId, uint8_t unitId, uint8_t* buffer) {
+    put16(buffer, transactionId);
+    put16(buffer + 2, 0); // protocol id is always 0 for Modbus
+    buffer[6] = unitId;
+    buffer[7] = static_cast<uint8_t>(transaction.function);
+    put16(buffer + 8, transaction.address);
+    size_t frameLength = 10;
+
+    switch(transaction.function) {
+      case MODBUS_FC_WRITE_SINGLE_COIL:
+        put16(buffer + frameLength, *static_cast<const uint8_t*>(transaction.data) ? 0xFF00 : 0);
+        frameLength += 2;
+        break;
+      case MODBUS_FC_WRITE_MULTIPLE_COILS: {
+        // pack the bits directly from the one-byte-per-bit buffer into the frame
+        put16(buffer + frameLength, transaction.length);
+        auto byteCount = size_t(transaction.length + 7) / 8;
+        buffer[frameLength + 2] = static_cast<uint8_t>(byteCount);
+        frameLength += 3;
+        const auto* bits = static_cast<const uint8_t*>(transaction.data);
+        for(size_t i = 0; i < byteCount; ++i) {
+          uint8_t packed = 0;
+          for(size_t bit = 0; bit < 8 && 8 * i + bit < size_t(transaction.length); ++bit) {
+            packed |= static_cast<uint8_t>((bits[8 * i + bit] ? 1 : 0) << bit);
+          }
+          buffer[frameLength + i] = packed;
+        }
+        frameLength += byteCount;
+        break;
+      }
+      case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        put16(buffer + frameLength, *static_cast<const uint16_t*>(transaction.data));
+        frameLength += 2;
+        break;
+      case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
+        put16(buffer + frameLength, transaction.length);
+        auto byteCount = 2 * size_t(transaction.length);
+        buffer[frameLength + 2] = static_cast<uint8_t>(byteCount);
+        frameLength += 3;
+        const auto* registers = static_cast<const uint16_t*>(transaction.data);
+        for(int i = 0; i < transaction.length; ++i) {
+          put16(buffer + frameLength + 2 * i, registers[i]);
+        }
+        frameLength += byteCount;
+        break;
+      }
+      default:
+        // read requests: quantity of bits/registers
+        put16(buffer + frameLength, transaction.length);
+        frameLength += 2;
+    }
+
+    // the length field counts all bytes following it (unit id + PDU)
+    put16(buffer + 4, static_cast<int>(frameLength - 6));
+    return frameLength;
+  }
+
+  /********************************************************************************************************************/
+
+  uint16_t transactionId(const uint8_t* frame) {
+    return get16(frame);
+  }
+
+  /********************************************************************************************************************/
+
+  size_t frameLength(const uint8_t* header) {
+    // the length field counts the unit id and the PDU, which has at least a function code and one byte of data
+    size_t length = get16(header + 4);
+    if(get16(header + 2) != 0 || length < 3 || length > maxLength - 6) {
+      return 0;
+    }
+    return 6 + length;
+  }
+
+  /********************************************************************************************************************/
+
+  int decodeResponse(const ModbusTransaction& transaction, uint8_t unitId, const uint8_t* frame, size_t frameLength) {
+    if(frameLength < headerLength + 2) {
+      return fail(EMBBADDATA);
+    }
+    if(frame[6] != unitId && unitId != MODBUS_BROADCAST_ADDRESS) {
+      return fail(EMBBADSLAVE);
+    }
+    auto function = frame[7];
+    if(function == (transaction.function | 0x80)) {
+      // exception response: map to the same errno values libmodbus uses
+      return fail(MODBUS_ENOBASE + frame[8]);
+    }
+    if(function != transaction.function) {
+      return fail(EMBBADDATA);
+    }
+
+    switch(function) {
+      case MODBUS_FC_READ_COILS:
+      case MODBUS_FC_READ_DISCRETE_INPUTS: {
+        // unpack the bits from the frame directly into the one-byte-per-bit buffer
+        size_t byteCount = frame[8];
+        if(byteCount != size_t(transaction.length + 7) / 8 || frameLength < headerLength + 2 + byteCount) {
+          return fail(EMBBADDATA);
+        }
+        auto* bits = static_cast<uint8_t*>(transaction.data);
+        const auto* packed = frame + headerLength + 2;
+        for(int i = 0; i < transaction.length; ++i) {
+          bits[i] = (packed[i / 8] >> (i % 8)) & 1;
+        }
+        return transaction.length;
+      }
+      case MODBUS_FC_WRITE_SINGLE_COIL:
+      case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return 1;
+      case MODBUS_FC_WRITE_MULTIPLE_COILS:
+      case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        if(frameLength < headerLength + 5) {
+          return fail(EMBBADDATA);
+        }
+        // the response echoes address and quantity
+        return get16(frame + headerLength + 3);
+      case MODBUS_FC_READ_HOLDING_REGISTERS:
+      case MODBUS_FC_READ_INPUT_REGISTERS: {
+        size_t byteCount = frame[8];
+        if(byteCount != 2 * size_t(transaction.length) || frameLength < headerLength + 2 + byteCount) {
+          return fail(EMBBADDATA);
+        }
+        auto* data = static_cast<uint16_t*>(transaction.data);
+        for(int i = 0; i < transaction.length; ++i) {
+          data[i] = get16(frame + headerLength + 2 + 2 * i);
+        }
+        return transaction.length;
+      }
+      default:
+        return fail(EMBBADDATA);
+    }
+  }
+
+  /********************************************************************************************************************/
+
+} // namespace ChimeraTK::ModbusTcpFrame
@@ -0,0 +1,323 @@
+// SPDX-FileCopyrightText: Helmholtz-Zentrum Dresden-Rossendorf, FWKE, ChimeraTK Project <chimeratk-support@desy.de>
+// SPDX-License-Identifier: LGPL-3.0-or-later
+#pragma once
+
+/*
+ * In-process Modbus TCP server used by the tests and the benchmark. The register content matches dummy.map.
+ */
+
+#include "modbus/modbus.h"
+
+#include <ChimeraTK/cppext/semaphore.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+/**********************************************************************************************************************/
+
+struct ModbusTestServer {
+  explicit ModbusTestServer(int port = 5555) : _serverPort(port) {
+    // create mapping
+    _mapping.nb_bits = sizeof(_map_coil);
+    _mapping.nb_input_bits = sizeof(_map_discreteinput);
+    _mapping.nb_registers = sizeof(_map_holding) / 2;
+    _mapping.nb_input_registers = sizeof(_map_input) / 2;
+    std::cout << _mapping.nb_bits << " " << _mapping.nb_input_bits << " " << _mapping.nb_registers << " "
+              << _mapping.nb_input_registers << "\n";
+    _mapping.start_bits = 0;
+    _mapping.start_input_bits = 0;
+    _mapping.start_registers = 0;
+    _mapping.start_input_registers = 1024 / 2; // map file address is in bytes, this on is in (16 bit) words
+    _mapping.tab_bits = static_cast<uint8_t*>(static_cast<void*>(&_map_coil));
+    _mapping.tab_input_bits = static_cast<uint8_t*>(static_cast<void*>(&_map_discreteinput));
+    _mapping.tab_registers = static_cast<uint16_t*>(static_cast<void*>(&_map_holding));
+    _mapping.tab_input_registers = static_cast<uint16_t*>(static_cast<void*>(&_map_input));
+
+    // launch server
+    _semServerLaunched.is_ready_and_reset();
+    _serverThread = boost::thread([this] { this->theServer(); });
+  }
+
+  ~ModbusTestServer() {
+    _shutdown = true;
+    auto* ctx = modbus_new_tcp("127.0.0.1", serverPort());
+    modbus_connect(ctx);
+    _serverThread.join();
+    modbus_free(ctx);
+  }
+
+  [[nodiscard]] int serverPort() const { return _serverPort; }
+
+  [[nodiscard]] size_t getRequestCount() const { return _nRequests; }
+
+  [[nodiscard]] size_t getConnectionCount() const { return _nConnections; }
+
+  /**
+   * Number of requests which have been answered while the next request on the same connection had already arrived,
+   * i.e. the client did not wait for the response before sending the next request.
+   */
+  [[nodiscard]] size_t getPipelinedRequestCount() const { return _nPipelined; }
+
+  /** CPU time consumed by the server thread (since it has been (re-)started). */
+  [[nodiscard]] std::chrono::nanoseconds getCpuTime() const { return std::chrono::nanoseconds(_cpuTime.load()); }
+
+  /** Delay each response by the given time, to simulate the processing time of a real device. */
+  void setLatency(std::chrono::microseconds latency) { _latency = latency.count(); }
+
+  /** Delay each response by the transmission time of request and response on an RTU line (0 disables). */
+  void setBaudRate(unsigned int baud) { _baudRate = baud; }
+
+  /** Close the connection instead of answering write requests, to simulate a connection failure during a write. */
+  void setDropWrites(bool enable) { _dropWrites = enable; }
+
+  struct __attribute__((packed)) MapHolding {
+    int16_t reg1[1]{0};
+    uint16_t reg2[1]{0};
+    int16_t reg3_raw[1]{0};
+    int32_t reg32[1]{0};
+    float reg754[1]{0};
+    int8_t padding{0};
+    int8_t reg8[1]{0};
+    int16_t array[10]{0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    int16_t table[300]{};
+  };
+  struct __attribute__((packed)) MapInput {
+    int16_t reg1[1]{0};
+    uint32_t huge[2000]{};
+  };
+  struct __attribute__((packed)) MapCoil {
+    int8_t bit1[1]{0};
+    int8_t bit2[1]{0};
+    int8_t array[8]{0, 0, 0, 0, 0, 0, 0, 0};
+    int8_t huge[3000]{};
+  };
+  struct __attribute__((packed)) MapDiscreteinput {
+    int8_t array[10]{0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    int8_t bit1[1]{0};
+    int8_t huge[2500]{};
+  };
+
+  std::unique_lock<std::mutex> getLock() { return std::unique_lock<std::mutex>(_mx_mapping); }
+  MapHolding& getHolding() { return _map_holding; }
+  MapInput& getInput() { return _map_input; }
+  MapCoil& getCoil() { return _map_coil; }
+  MapDiscreteinput& getDiscreteInput() { return _map_discreteinput; }
+
+  void setException(bool enable, size_t cause) {
+    assert(cause <= 2);
+    if(cause == 0) {
+      _exception = enable;
+    }
+    else if(cause == 1) {
+      if(enable) {
+        assert(_serverThread.joinable());
+        _shutdown = true;
+        while(_serverThread.joinable()) {
+          auto* ctx = modbus_new_tcp("127.0.0.1", serverPort());
+          modbus_connect(ctx);
+          _serverThread.try_join_for(boost::chrono::milliseconds(1));
+          modbus_free(ctx);
+        }
+      }
+      else {
+        assert(!_serverThread.joinable());
+        _shutdown = false;
+        _semServerLaunched.is_ready_and_reset();
+        _serverThread = boost::thread([this] { this->theServer(); });
+        _semServerLaunched.wait_and_reset();
+      }
+    }
+    else if(cause == 2) {
+      if(enable) {
+        _lk_timeout.lock();
+      }
+      else {
+        _lk_timeout.unlock();
+      }
+    }
+  }
+
+ protected:
+  void theServer() {
+    // Create modbus server
+    modbus_t* ctx = modbus_new_tcp("0.0.0.0", serverPort());
+    int server_socket = modbus_tcp_listen(ctx, 1);
+    if(server_socket == -1) {
+      modbus_free(ctx);
+      std::cerr << "Test setup error: Unable to listen TCP connection\n";
+      throw std::runtime_error("Test setup error: Unable to listen TCP connection");
+    }
+
+    // Prepare set of FDs for select() with just the server socket in for now. (Client connections will be added later
+    // when requests come in.)
+    fd_set refset;
+    FD_ZERO(&refset);
+    FD_SET(server_socket, &refset);
+
+    // Keep track of the max file descriptor, needed for select()
+    auto fdmax = server_socket;
+
+    _semServerLaunched.unlock();
+
+    for(;;) {
+      // Wait for any of the connections / server socket to receive data
+      fd_set rdset = refset;
+      if(select(fdmax + 1, &rdset, nullptr, nullptr, nullptr) == -1) {
+        std::cerr << "Server select() failure.\n";
+        throw std::runtime_error("Test error: Server select() failure");
+      }
+
+      // shutdown thread?
+      if(_shutdown) {
+        close(server_socket);
+        modbus_free(ctx);
+        return;
+      }
+
+      // Check which socket has received data
+      for(int master_socket = 0; master_socket <= fdmax; master_socket++) {
+        if(!FD_ISSET(master_socket, &rdset)) {
+          continue;
+        }
+
+        // New data on server_socket: new client tries to connect
+        if(master_socket == server_socket) {
+          // Create new connection
+          sockaddr_in clientaddr{};
+          socklen_t addrlen = sizeof(clientaddr);
+          memset(&clientaddr, 0, sizeof(clientaddr));
+          int newfd = accept(server_socket, static_cast<sockaddr*>(static_cast<void*>(&clientaddr)), &addrlen);
+          if(newfd == -1) {
+            std::cerr << "Server accept() failure.\n";
+            throw std::runtime_error("Test error: Server accept() failure");
+          }
+          ++_nConnections;
+          // Add new
+          FD_SET(newfd, &refset);
+
+          if(newfd > fdmax) {
+            /* Keep track of the maximum */
+            fdmax = newfd;
+          }
+        }
+        // Data received on any other socket: client is requesting read/write
+        else {
+          // Process request
+          modbus_set_socket(ctx, master_socket);
+          static uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH]; // static to prevent need for big stack
+          int rc = modbus_receive(ctx, query);
+          if(rc > 0 && _dropWrites && isWriteRequest(query)) {
+            ++_nRequests;
+            close(master_socket);
+            FD_CLR(master_socket, &refset);
+          }
+          else if(rc > 0) {
+            ++_nRequests;
+            simulateDelay(query, rc);
+            // modbus_receive() reads exactly one frame, so any pending data belongs to the next request
+            int pending = 0;
+            if(ioctl(master_socket, FIONREAD, &pending) == 0 && pending > 0) {
+              ++_nPipelined;
+            }
+            if(!_exception) {
+              std::unique_lock<std::mutex> lk(_mx_mapping);
+              modbus_reply(ctx, query, rc, &_mapping);
+            }
+            else {
+              modbus_reply_exception(ctx, query, MODBUS_EXCEPTION_NOT_DEFINED);
+            }
+            timespec cpuTime{};
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuTime);
+            _cpuTime = int64_t(cpuTime.tv_sec) * 1000000000 + cpuTime.tv_nsec;
+          }
+          else if(rc == -1) {
+            close(master_socket);
+            FD_CLR(master_socket, &refset);
+          }
+        }
+      }
+    }
+  }
+
+  // sleep for the injected latency plus the transmission time on the simulated RTU line
+  void simulateDelay(const uint8_t* query, int queryLength) {
+    auto delay = std::chrono::microseconds(_latency.load());
+    auto baud = _baudRate.load();
+    if(baud > 0) {
+      // RTU frames have 1 byte address and 2 bytes CRC instead of the 7 bytes MBAP header. Each character takes 10
+      // bits (start, 8 data, stop). Each frame is followed by 3.5 characters of silence.
+      auto nCharacters = (queryLength - 4) + rtuResponseLength(query) + 7;
+      delay += std::chrono::microseconds(int64_t(nCharacters) * 10 * 1000000 / baud);
+    }
+    if(delay.count() > 0) {
+      std::this_thread::sleep_for(delay);
+    }
+  }
+
+  static bool isWriteRequest(const uint8_t* query) {
+    switch(query[7]) {
+      case MODBUS_FC_WRITE_SINGLE_COIL:
+      case MODBUS_FC_WRITE_SINGLE_REGISTER:
+      case MODBUS_FC_WRITE_MULTIPLE_COILS:
+      case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // length of the RTU response frame to the given TCP query
+  static int rtuResponseLength(const uint8_t* query) {
+    int quantity = (query[10] << 8) | query[11];
+    switch(query[7]) {
+      case MODBUS_FC_READ_COILS:
+      case MODBUS_FC_READ_DISCRETE_INPUTS:
+        return 3 + 2 + (quantity + 7) / 8;
+      case MODBUS_FC_READ_HOLDING_REGISTERS:
+      case MODBUS_FC_READ_INPUT_REGISTERS:
+      case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        return 3 + 2 + 2 * quantity;
+      default:
+        return 3 + 5;
+    }
+  }
+
+  int _serverPort;
+
+  std::mutex _mx_mapping;
+  modbus_mapping_t _mapping{};
+
+  MapHolding _map_holding{};
+  MapInput _map_input{};
+  MapCoil _map_coil{};
+  MapDiscreteinput _map_discreteinput{};
+
+  boost::thread _serverThread;
+
+  std::atomic<bool> _shutdown{false};
+  std::atomic<bool> _exception{false};
+  std::atomic<bool> _dropWrites{false};
+  std::atomic<size_t> _nRequests{0};
+  std::atomic<size_t> _nConnections{0};
+  std::atomic<size_t> _nPipelined{0};
+  std::atomic<int64_t> _cpuTime{0};
+  std::atomic<int64_t> _latency{0};
+  std::atomic<unsigned int> _baudRate{0};
+  std::unique_lock<std::mutex> _lk_timeout{_mx_mapping, std::defer_lock};
+
+  cppext::semaphore _semServerLaunched;
+};